@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Userspace benchmark for the frame encoder. Builds jpegenc.c and
+ * encoder.c against the headers in shim/ and runs them over the splash
+ * BMP and synthetic UI, video and noise frames.
+ *
+ * Copyright (C) 2025 embeddedboys, Ltd.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../encoder.h"
+#include "../jpegenc.h"
+#include "../rgb565.h"
+
+#define BENCH_VARIANTS  8
+
+/* the driver caps a frame at its transfer buffer */
+#define BENCH_BUDGET    (40000 - 1)
+
+int bench_cpus = 1;
+bool bench_simd = true;
+extern bool *bench_param_optimize_huffman;
+static bool bench_profile = true;
+static bool bench_xrgb;
+
+uint64_t JPEGStageTicks[JPEGE_STAGE_COUNT];
+
+uint64_t JPEGProfileTicks(void)
+{
+    if (!bench_profile)
+        return 0;
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    {
+        uint64_t cnt;
+
+        asm volatile("isb; mrs %0, cntvct_el0" : "=r"(cnt));
+        return cnt;
+    }
+#else
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+#endif
+}
+
+static const char * const stage_names[JPEGE_STAGE_COUNT] = {
+    "convert", "fdct", "quantize", "huffman",
+};
+
+static uint32_t seed = 1;
+
+static uint32_t bench_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static uint16_t rgb(int r, int g, int b)
+{
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+/* Flat panels, window borders and lines of 'text', moved a bit per variant */
+static void fill_ui(uint16_t *fb, int w, int h, int variant)
+{
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            uint16_t c = rgb(0xee, 0xee, 0xec);
+
+            if (y < 24)
+                c = rgb(0x30, 0x30, 0x38);
+            else if (x < w / 4)
+                c = rgb(0xd8, 0xdc, 0xe0);
+            if (x == w / 4 || y == 24)
+                c = rgb(0x90, 0x90, 0x90);
+            if (y > 40 && (y - 40) % 18 < 10 && x > w / 4 + 12 &&
+                x < w - 12 - (((y + variant * 18) / 18) * 37) % (w / 3) &&
+                ((x * 7 + y * 3 + variant) % 11) < 6)
+                c = rgb(0x20, 0x20, 0x20);
+            fb[y * w + x] = c;
+        }
+    }
+}
+
+/* Smooth gradients with a drifting bright disc and some sensor noise */
+static void fill_video(uint16_t *fb, int w, int h, int variant)
+{
+    int cx = w / 4 + variant * w / (2 * BENCH_VARIANTS);
+    int cy = h / 2 + (variant & 1) * 8;
+    int x, y, r, g, b, d;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            r = x * 255 / w;
+            g = y * 255 / h;
+            b = 128 + (x - y) / 4;
+            d = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+            if (d < h * h / 16) {
+                r = 255 - d * 64 / (h * h / 16);
+                g = r * 3 / 4;
+            }
+            r += bench_rand() % 9 - 4;
+            g += bench_rand() % 9 - 4;
+            fb[y * w + x] = rgb(r < 0 ? 0 : r > 255 ? 255 : r,
+                                g < 0 ? 0 : g > 255 ? 255 : g,
+                                b < 0 ? 0 : b > 255 ? 255 : b);
+        }
+    }
+}
+
+static void fill_noise(uint16_t *fb, int w, int h, int variant)
+{
+    int i;
+
+    for (i = 0; i < w * h; i++)
+        fb[i] = bench_rand();
+}
+
+struct bench_frame {
+    const char *name;
+    void (*fill)(uint16_t *fb, int w, int h, int variant);
+};
+
+/* The same frame as XRGB8888, channels widened the way the encoder does */
+static uint8_t *to_xrgb8888(const uint16_t *fb, int w, int h)
+{
+    uint32_t *out = malloc(w * h * sizeof(uint32_t));
+    uint32_t r, g, b;
+    int i;
+
+    if (!out)
+        return NULL;
+    for (i = 0; i < w * h; i++) {
+        r = ((fb[i] & 0xf800) >> 8) | ((fb[i] & 0x3800) >> 11);
+        g = ((fb[i] & 0x7e0) >> 3) | ((fb[i] & 0x60) >> 5);
+        b = ((fb[i] & 0x1f) << 3) | (fb[i] & 7);
+        out[i] = 0xff000000 | r << 16 | g << 8 | b;
+    }
+    return (uint8_t *)out;
+}
+
+static const struct bench_frame frames[] = {
+    { "bmp", NULL },
+    { "ui", fill_ui },
+    { "video", fill_video },
+    { "noise", fill_noise },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(struct jpeg_session *session, const struct bench_frame *frame,
+               int width, int height, int iterations, size_t budget)
+{
+    uint8_t *fb[BENCH_VARIANTS] = { NULL };
+    size_t size, total = 0, in_bytes;
+    int cpp = bench_xrgb ? 4 : 2;
+    uint64_t ticks = 0;
+    int i, rc = 0, dropped = 0;
+    uint8_t *out;
+    double t;
+
+    out = malloc(budget + JPEG_ENCODE_SLACK);
+    if (!out)
+        return -ENOMEM;
+
+    if (frame->fill) {
+        for (i = 0; i < BENCH_VARIANTS; i++) {
+            fb[i] = malloc(width * height * sizeof(uint16_t));
+            if (!fb[i]) {
+                rc = -ENOMEM;
+                goto err_free;
+            }
+            frame->fill((uint16_t *)fb[i], width, height, i);
+            if (bench_xrgb) {
+                uint8_t *xrgb = to_xrgb8888((uint16_t *)fb[i], width, height);
+
+                free(fb[i]);
+                fb[i] = xrgb;
+                if (!fb[i]) {
+                    rc = -ENOMEM;
+                    goto err_free;
+                }
+            }
+        }
+        in_bytes = width * height * cpp;
+    } else {
+        in_bytes = *(int32_t *)&rgb565[18] * abs(*(int32_t *)&rgb565[22]) *
+                   sizeof(uint16_t);
+    }
+
+    memset(JPEGStageTicks, 0, sizeof(JPEGStageTicks));
+    t = now();
+    for (i = 0; i < iterations; i++) {
+        if (frame->fill && bench_xrgb)
+            rc = jpeg_encode_xrgb8888(session, fb[i % BENCH_VARIANTS],
+                                      width, height, width * cpp,
+                                      out, budget, &size);
+        else if (frame->fill)
+            rc = jpeg_encode_rgb565(session, fb[i % BENCH_VARIANTS],
+                                    width, height, width * cpp,
+                                    out, budget, &size);
+        else
+            rc = jpeg_encode_bmp(session, rgb565, sizeof(rgb565),
+                                 out, budget, &size);
+        if (rc == -ENOSPC) {
+            dropped++;
+            continue;
+        }
+        if (rc)
+            goto err_free;
+        total += size;
+    }
+    t = now() - t;
+
+    printf("%-6s %8.1f MB/s %8.1f fps %8zu bytes/frame",
+           frame->name, in_bytes * (double)iterations / t / 1e6,
+           iterations / t, iterations > dropped ? total / (iterations - dropped) : 0);
+    if (dropped)
+        printf(" %d over budget", dropped);
+    printf("\n");
+
+    for (i = 0; i < JPEGE_STAGE_COUNT; i++)
+        ticks += JPEGStageTicks[i];
+    if (ticks) {
+        printf("      ");
+        for (i = 0; i < JPEGE_STAGE_COUNT; i++)
+            printf(" %s %4.1f%%", stage_names[i],
+                   JPEGStageTicks[i] * 100.0 / ticks);
+        printf("\n");
+    }
+    rc = 0;
+
+err_free:
+    for (i = 0; i < BENCH_VARIANTS; i++)
+        free(fb[i]);
+    free(out);
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-w width] [-h height] [-b budget]\n"
+            "          [-j cpus] [-s] [-q] [-x] [-o] [frame...]\n"
+            "  -s  scalar code only\n"
+            "  -o  Huffman tables built from the frames\n"
+            "  -x  synthetic frames as XRGB8888\n"
+            "  -q  no per-stage timing\n"
+            "  frames: bmp ui video noise (default all)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int width = 480, height = 320, iterations = 200;
+    size_t budget = BENCH_BUDGET;
+    struct jpeg_session *session;
+    int opt, i, j, rc = 0;
+
+    while ((opt = getopt(argc, argv, "n:w:h:b:j:sqxo")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'b':
+            budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            bench_cpus = atoi(optarg);
+            break;
+        case 's':
+            bench_simd = false;
+            break;
+        case 'q':
+            bench_profile = false;
+            break;
+        case 'x':
+            bench_xrgb = true;
+            break;
+        case 'o':
+            *bench_param_optimize_huffman = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0 || width <= 0 || height <= 0 || bench_cpus <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    session = jpeg_session_alloc();
+    if (!session) {
+        fprintf(stderr, "no memory for the encoder\n");
+        return 1;
+    }
+
+    printf("%dx%d %s, %d frames, budget %zu, %d cpu%s, %s%s\n", width, height,
+           bench_xrgb ? "XRGB8888" : "RGB565", iterations, budget, bench_cpus,
+           bench_cpus > 1 ? "s" : "", bench_simd ? "vector" : "scalar",
+           *bench_param_optimize_huffman ? ", optimized Huffman" : "");
+
+    for (i = 0; i < (int)ARRAY_SIZE(frames) && !rc; i++) {
+        if (optind < argc) {
+            for (j = optind; j < argc; j++)
+                if (!strcmp(argv[j], frames[i].name))
+                    break;
+            if (j == argc)
+                continue;
+        }
+        rc = run(session, &frames[i], width, height, iterations, budget);
+        if (rc)
+            fprintf(stderr, "%s: encode failed (%d)\n", frames[i].name, rc);
+    }
+
+    jpeg_session_free(session);
+    return rc ? 1 : 0;
+}
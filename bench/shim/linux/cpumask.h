@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_CPUMASK_H
+#define __BENCH_LINUX_CPUMASK_H
+
+#include <linux/kernel.h>
+
+/* CPUs the encoder may spread bands over, set by bench -j */
+extern int bench_cpus;
+
+#define nr_cpu_ids bench_cpus
+#define cpu_online_mask NULL
+#define num_online_cpus() bench_cpus
+#define raw_smp_processor_id() 0
+
+static inline int cpumask_first(const void *mask)
+{
+    return 0;
+}
+
+static inline int cpumask_next(int cpu, const void *mask)
+{
+    return cpu + 1;
+}
+
+#endif
@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_ERRNO_H
+#define __BENCH_LINUX_ERRNO_H
+
+#include <asm-generic/errno.h>
+
+#endif
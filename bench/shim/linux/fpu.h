@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_FPU_H
+#define __BENCH_LINUX_FPU_H
+
+#include <linux/kernel.h>
+
+/* Vector paths on or off, cleared by bench -s */
+extern bool bench_simd;
+
+#define kernel_fpu_available() bench_simd
+#define kernel_fpu_begin() do { } while (0)
+#define kernel_fpu_end() do { } while (0)
+
+#endif
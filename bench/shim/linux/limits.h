@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_LIMITS_H
+#define __BENCH_LINUX_LIMITS_H
+
+/* the libc headers want the uapi one too */
+#include_next <linux/limits.h>
+#include <limits.h>
+
+#endif
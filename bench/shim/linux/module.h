@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_MODULE_H
+#define __BENCH_LINUX_MODULE_H
+
+#include <linux/kernel.h>
+
+/* bench.c sets the parameters through bench_param_<name> */
+#define module_param(name, type, perm) __typeof__(name) *bench_param_##name = &name
+#define MODULE_PARM_DESC(name, desc)
+
+#endif
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_SLAB_H
+#define __BENCH_LINUX_SLAB_H
+
+#include <linux/kernel.h>
+
+#define GFP_KERNEL 0
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kfree(p) free(p)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvfree(p) free(p)
+
+#endif
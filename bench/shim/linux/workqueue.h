@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __BENCH_LINUX_WORKQUEUE_H
+#define __BENCH_LINUX_WORKQUEUE_H
+
+#include <pthread.h>
+#include <linux/kernel.h>
+
+/* One thread per queued work item, joined by flush_work() */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+    work_func_t func;
+    pthread_t thread;
+    bool queued;
+};
+
+struct workqueue_struct {
+    int unused;
+};
+
+#define WQ_HIGHPRI 0
+
+#define INIT_WORK(work, fn) \
+    do { (work)->func = (fn); (work)->queued = false; } while (0)
+
+static inline struct workqueue_struct *alloc_workqueue(const char *fmt,
+                                                       unsigned int flags,
+                                                       int max_active)
+{
+    return calloc(1, sizeof(struct workqueue_struct));
+}
+
+static inline void destroy_workqueue(struct workqueue_struct *wq)
+{
+    free(wq);
+}
+
+static inline void *work_thread(void *arg)
+{
+    struct work_struct *work = arg;
+
+    work->func(work);
+    return NULL;
+}
+
+static inline bool queue_work_on(int cpu, struct workqueue_struct *wq,
+                                 struct work_struct *work)
+{
+    if (pthread_create(&work->thread, NULL, work_thread, work)) {
+        work->func(work);
+        return true;
+    }
+    work->queued = true;
+    return true;
+}
+
+static inline bool flush_work(struct work_struct *work)
+{
+    if (!work->queued)
+        return false;
+    pthread_join(work->thread, NULL);
+    work->queued = false;
+    return true;
+}
+
+#endif
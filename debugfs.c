@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *
+ * Copyright (C) 2025 embeddedboys, Ltd.
+ *
+ * Author: Zheng Hua <hua.zheng@embeddedboys.com>
+ */
+
+#define pr_fmt(fmt) "udd-debugfs: " fmt
+
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+
+#include "udd.h"
+
+/*
+ * Per-device performance counters. The hot paths only bump counters of
+ * the CPU they run on; <debugfs>/udd/<interface>/stats sums them up.
+ * Writing to the file starts the counts over.
+ */
+
+static struct dentry *udd_debugfs_root;
+
+static const char * const udd_hist_names[UDD_HIST_COUNT] = {
+    [UDD_HIST_COPY]   = "copy_us",
+    [UDD_HIST_ENCODE] = "encode_us",
+    [UDD_HIST_TX]     = "tx_us",
+    [UDD_HIST_BYTES]  = "bytes",
+};
+
+int udd_stats_init(struct udd *udd)
+{
+    udd->stats = alloc_percpu(struct udd_stats);
+    if (!udd->stats)
+        return -ENOMEM;
+
+    udd->stats_since = ktime_get();
+    return 0;
+}
+
+void udd_stats_release(struct udd *udd)
+{
+    free_percpu(udd->stats);
+    udd->stats = NULL;
+}
+
+static void udd_stats_sum(struct udd *udd, struct udd_stats *sum)
+{
+    struct udd_stats *stats;
+    int cpu, h, b;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(udd->stats, cpu);
+        sum->frames += READ_ONCE(stats->frames);
+        sum->bytes += READ_ONCE(stats->bytes);
+        sum->dropped += READ_ONCE(stats->dropped);
+        sum->oversize += READ_ONCE(stats->oversize);
+        sum->tx_errors += READ_ONCE(stats->tx_errors);
+        for (h = 0; h < UDD_HIST_COUNT; h++)
+            for (b = 0; b < UDD_HIST_BUCKETS; b++)
+                sum->hist[h][b] += READ_ONCE(stats->hist[h][b]);
+    }
+}
+
+static int udd_stats_show(struct seq_file *m, void *unused)
+{
+    struct udd *udd = m->private;
+    struct udd_stats *sum;
+    u64 us, fps;
+    int h, b;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    udd_stats_sum(udd, sum);
+
+    us = max_t(u64, ktime_us_delta(ktime_get(), udd->stats_since), 1);
+    fps = div64_u64(sum->frames * USEC_PER_SEC * 10, us);
+
+    seq_printf(m, "seconds:     %llu\n", div_u64(us, USEC_PER_SEC));
+    seq_printf(m, "frames:      %llu\n", sum->frames);
+    seq_printf(m, "fps:         %llu.%llu\n", div_u64(fps, 10), fps % 10);
+    seq_printf(m, "bytes:       %llu\n", sum->bytes);
+    seq_printf(m, "dropped:     %llu\n", sum->dropped);
+    seq_printf(m, "oversize:    %llu\n", sum->oversize);
+    seq_printf(m, "tx_errors:   %llu\n", sum->tx_errors);
+    seq_printf(m, "link_rate:   %u\n", READ_ONCE(udd->tx_rate));
+    seq_printf(m, "decode_rate: %u\n", READ_ONCE(udd->tx_decode_rate));
+    seq_printf(m, "latency_us:  %u\n", READ_ONCE(udd->tx_latency));
+
+    /* one line per histogram, upper bound of each non-empty bucket */
+    for (h = 0; h < UDD_HIST_COUNT; h++) {
+        seq_printf(m, "%-12s", udd_hist_names[h]);
+        for (b = 0; b < UDD_HIST_BUCKETS; b++) {
+            if (!sum->hist[h][b])
+                continue;
+            if (b == UDD_HIST_BUCKETS - 1)
+                seq_printf(m, " inf:%llu", sum->hist[h][b]);
+            else
+                seq_printf(m, " <%llu:%llu", 1ULL << b, sum->hist[h][b]);
+        }
+        seq_putc(m, '\n');
+    }
+
+    kfree(sum);
+    return 0;
+}
+
+static int udd_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, udd_stats_show, inode->i_private);
+}
+
+/* Counts taken while clearing may survive it, good enough to start over */
+static ssize_t udd_stats_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+    struct udd *udd = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(udd->stats, cpu), 0, sizeof(struct udd_stats));
+    udd->stats_since = ktime_get();
+
+    return count;
+}
+
+static const struct file_operations udd_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = udd_stats_open,
+    .read    = seq_read,
+    .write   = udd_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+void udd_debugfs_init(struct udd *udd)
+{
+    udd->debugfs = debugfs_create_dir(dev_name(udd->dev), udd_debugfs_root);
+    debugfs_create_file("stats", 0600, udd->debugfs, udd, &udd_stats_fops);
+}
+
+void udd_debugfs_release(struct udd *udd)
+{
+    debugfs_remove_recursive(udd->debugfs);
+    udd->debugfs = NULL;
+}
+
+void udd_debugfs_register(void)
+{
+    udd_debugfs_root = debugfs_create_dir("udd", NULL);
+}
+
+void udd_debugfs_unregister(void)
+{
+    debugfs_remove_recursive(udd_debugfs_root);
+}
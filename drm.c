@@ -12,13 +12,28 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
 #include <video/mipi_display.h>
 
+#include <drm/drm_prime.h>
+
 #include "udd.h"
+#include "udd_trace.h"
 #include "encoder.h"
 
 #define DRV_NAME "udd-drm"
 
+/*
+ * The encoder reads every pixel of the scanout buffers with the CPU, and
+ * only the CPU touches them unless they are shared through dma-buf, so
+ * they do not need to be uncached.
+ */
+static bool cached_fb = true;
+module_param(cached_fb, bool, 0444);
+MODULE_PARM_DESC(cached_fb, "Back framebuffers with cached memory instead of write-combined");
+
 static inline struct udd *drm_to_udd(struct drm_device *drm)
 {
     return container_of(drm, struct udd, drm);
@@ -38,12 +53,69 @@ static void udd_drm_pipe_enable(struct drm_simple_display_pipe *pipe,
 				  struct drm_crtc_state *crtc_state,
 				  struct drm_plane_state *plane_state)
 {
+    struct udd *udd = drm_to_udd(pipe->crtc.dev);
+
     pr_info("%s\n", __func__);
+
+    /* the first frame after a modeset is sent in full */
+    udd_tiles_invalidate(udd);
+
+    drm_crtc_vblank_on(&pipe->crtc);
 }
 
 static void udd_drm_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
+    struct udd *udd = drm_to_udd(pipe->crtc.dev);
+
     pr_info("%s\n", __func__);
+
+    /* finish the frame in the mailbox and complete its flip */
+    flush_work(&udd->fb_work);
+    drm_crtc_vblank_off(&pipe->crtc);
+}
+
+/*
+ * There is no scanout to follow, vblank is an hrtimer ticking at the rate
+ * the link is budgeted for, or at the mode refresh without one. Flips are
+ * completed on these ticks, which paces clients to what the device can
+ * take.
+ */
+static enum hrtimer_restart udd_vblank_timer_fn(struct hrtimer *timer)
+{
+    struct udd *udd = container_of(timer, struct udd, vblank_timer);
+
+    /* vblank was turned off, let the timer die */
+    if (!drm_crtc_handle_vblank(&udd->pipe.crtc))
+        return HRTIMER_NORESTART;
+
+    hrtimer_forward_now(timer, udd->vblank_period);
+    return HRTIMER_RESTART;
+}
+
+static int udd_drm_pipe_enable_vblank(struct drm_simple_display_pipe *pipe)
+{
+    struct udd *udd = drm_to_udd(pipe->crtc.dev);
+    u32 rate = 0;
+
+    if (udd->display)
+        rate = udd->display->fps;
+    if (!rate)
+        rate = drm_mode_vrefresh(&udd->mode);
+    if (!rate)
+        rate = 60;
+
+    udd->vblank_period = ns_to_ktime(NSEC_PER_SEC / rate);
+    hrtimer_start(&udd->vblank_timer, udd->vblank_period, HRTIMER_MODE_REL);
+
+    return 0;
+}
+
+static void udd_drm_pipe_disable_vblank(struct drm_simple_display_pipe *pipe)
+{
+    struct udd *udd = drm_to_udd(pipe->crtc.dev);
+
+    /* called under the vblank lock the timer takes, must not wait for it */
+    hrtimer_try_to_cancel(&udd->vblank_timer);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
@@ -55,7 +127,6 @@ static int udd_buf_copy(void *dst, struct iosys_map *src, struct drm_framebuffer
                         struct drm_rect *clip, bool swap)
 #endif
 {
-    struct udd *udd = drm_to_udd(fb->dev);
     struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
     struct iosys_map dst_map = IOSYS_MAP_INIT_VADDR(dst);
     int ret;
@@ -81,22 +152,8 @@ static int udd_buf_copy(void *dst, struct iosys_map *src, struct drm_framebuffer
         drm_fb_memcpy(&dst_map, NULL, src, fb, clip);
         break;
     case DRM_FORMAT_XRGB8888:
-        switch (udd->pixel_format) {
-        case DRM_FORMAT_RGB565:
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
-            drm_fb_xrgb8888_to_rgb565(&dst_map, NULL, src, fb, clip, fmtcnv_state, swap);
-#else
-            drm_fb_xrgb8888_to_rgb565(&dst_map, NULL, src, fb, clip, swap);
-#endif
-            break;
-        case DRM_FORMAT_RGB888:
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
-            drm_fb_xrgb8888_to_rgb888(&dst_map, NULL, src, fb, clip, fmtcnv_state);
-#else
-            drm_fb_xrgb8888_to_rgb888(&dst_map, NULL, src, fb, clip);
-#endif
-            break;
-        }
+        /* the encoder takes it as is, no RGB565 round trip */
+        drm_fb_memcpy(&dst_map, NULL, src, fb, clip);
         break;
     default:
         drm_err_once(fb->dev, "Format is not supported: %p4cc\n",
@@ -109,6 +166,139 @@ static int udd_buf_copy(void *dst, struct iosys_map *src, struct drm_framebuffer
     return ret;
 }
 
+/* Encode pixels of the framebuffer format, lines pitch bytes apart */
+static int udd_fb_encode(struct udd *udd, const struct drm_format_info *format,
+                         u8 *pixels, int width, int height, int pitch,
+                         u8 *out, size_t budget, size_t *len)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    trace_udd_encode_begin(udd->frame, width, height, budget);
+    if (format->format == DRM_FORMAT_XRGB8888)
+        ret = jpeg_encode_xrgb8888(udd->jpeg, pixels, width, height, pitch,
+                                   out, budget, len);
+    else
+        ret = jpeg_encode_rgb565(udd->jpeg, pixels, width, height, pitch,
+                                 out, budget, len);
+
+    udd_stat_hist(udd, UDD_HIST_ENCODE, udd_stat_us(start));
+    trace_udd_encode_end(udd->frame, ret ? 0 : *len, ret);
+    if (ret) {
+        udd_stat_inc(udd, oversize);
+        udd_stat_inc(udd, dropped);
+    }
+
+    return ret;
+}
+
+/*
+ * Encode only the changed tiles of the scanned area and send them, in at
+ * most budget bytes with the tile list.
+ */
+static int udd_fb_send_tiles(struct udd *udd, const struct drm_format_info *format,
+                             const u8 *pixels, unsigned int pitch,
+                             const struct drm_rect *rect, unsigned int count,
+                             size_t budget)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+    size_t index_size = count * sizeof(*tiles->dirty);
+    struct udd_tx_slot *slot;
+    size_t jpeg_length;
+    u16 width, height;
+    ktime_t start = ktime_get();
+    ssize_t ret;
+
+    trace_udd_copy_begin(udd->frame, count * UDD_MCU_SIZE * UDD_MCU_SIZE *
+                                     format->cpp[0]);
+    udd_tiles_pack(udd, pixels, format->cpp[0], pitch, rect, &width, &height);
+    udd_stat_hist(udd, UDD_HIST_COPY, udd_stat_us(start));
+    trace_udd_copy_end(udd->frame, count * UDD_MCU_SIZE * UDD_MCU_SIZE *
+                                   format->cpp[0]);
+
+    slot = udd_tx_get(udd);
+    if (IS_ERR(slot))
+        return PTR_ERR(slot);
+
+    memcpy(slot->buf, tiles->dirty, index_size);
+    ret = udd_fb_encode(udd, format, tiles->buf, width, height,
+                        width * format->cpp[0], slot->buf + index_size,
+                        budget - index_size, &jpeg_length);
+    if (ret) {
+        pr_warn_ratelimited("%s, tiles do not fit the link, dropped\n", __func__);
+        udd_tx_put(udd, slot);
+        return ret;
+    }
+
+    ret = udd_flush_tiles(udd, slot, count, width / UDD_MCU_SIZE,
+                          index_size + jpeg_length);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Send the damaged area rect, whose top left pixel is at pixels with
+ * lines pitch bytes apart.
+ */
+static void udd_fb_send(struct udd *udd, struct drm_framebuffer *fb,
+                        u8 *pixels, unsigned int pitch, struct drm_rect *rect)
+{
+    unsigned int height = rect->y2 - rect->y1;
+    unsigned int width = rect->x2 - rect->x1;
+    struct udd_tx_slot *slot;
+    size_t jpeg_length = 0;
+    unsigned int count;
+    size_t budget;
+    ssize_t ret = 0;
+    bool full;
+
+    full = width == fb->width && height == fb->height;
+
+    count = udd_tiles_scan(udd, pixels, fb->format->cpp[0], pitch, rect);
+    if (!count)
+        return;
+    budget = udd_tx_budget(udd);
+
+    /*
+     * A few changed tiles go out on their own; when most of the area
+     * changed, the plain region is cheaper than the tile list. The list
+     * must leave the JPEG at least the smallest budget.
+     */
+    if ((udd->caps.features & UDD_FEAT_TILES) && !udd->tiles.clipped &&
+        count * 4 <= 3 * DIV_ROUND_UP(width, UDD_MCU_SIZE) *
+                         DIV_ROUND_UP(height, UDD_MCU_SIZE) &&
+        count * sizeof(*udd->tiles.dirty) + UDD_TX_MIN_BUDGET <= budget) {
+        ret = udd_fb_send_tiles(udd, fb->format, pixels, pitch, rect, count,
+                                budget);
+        if (ret)
+            udd_tiles_forget(udd);
+        return;
+    }
+
+    slot = udd_tx_get(udd);
+    if (IS_ERR(slot)) {
+        udd_tiles_forget(udd);
+        return;
+    }
+
+    ret = udd_fb_encode(udd, fb->format, pixels, width, height, pitch,
+                        slot->buf, budget, &jpeg_length);
+    if (ret) {
+        pr_warn_ratelimited("%s, frame does not fit the link, dropped\n", __func__);
+        udd_tx_put(udd, slot);
+        udd_tiles_forget(udd);
+        return;
+    }
+
+    if (full)
+        ret = udd_flush(udd, slot, jpeg_length);
+    else
+        ret = udd_flush_region(udd, slot, rect->x1, rect->y1, width, height,
+                               jpeg_length);
+    if (ret < 0)
+        udd_tiles_forget(udd);
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
 static void udd_fb_dirty(struct iosys_map *src, struct drm_framebuffer *fb,
                         struct drm_rect *rect, struct drm_format_conv_state *fmtcnv_state)
@@ -118,107 +308,199 @@ static void udd_fb_dirty(struct iosys_map *src, struct drm_framebuffer *fb,
 #endif
 {
     struct udd *udd = drm_to_udd(fb->dev);
-    unsigned int height = rect->y2 - rect->y1;
-    unsigned int width = rect->x2 - rect->x1;
-    // const struct drm_format_info *dst_format;
-    ssize_t jpeg_length = 0;
-    u8 *jpeg_data;
+    unsigned int pitch = fb->pitches[0];
     bool swap = false;
-    int ret = 0;
-    // size_t len;
-    bool full;
-    void *tr;
-
-    full = width == fb->width && height == fb->height;
+    ssize_t ret = 0;
+    ktime_t start;
+    size_t size;
+
+    /*
+     * Both formats we offer are read by the encoder as they are, so the
+     * framebuffer mapping is encoded in place. Only I/O memory, which may not
+     * be read like RAM, goes through tx_buf.
+     */
+    if (!src->is_iomem) {
+        ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
+        if (ret) {
+            udd_tiles_invalidate(udd);
+            return;
+        }
+        udd_fb_send(udd, fb, src->vaddr + drm_fb_clip_offset(pitch, fb->format, rect),
+                    pitch, rect);
+        drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+        return;
+    }
 
-    tr = udd->tx_buf;
+    /* The damaged area is copied packed, width pixels per line */
+    size = drm_rect_width(rect) * drm_rect_height(rect) * fb->format->cpp[0];
+    trace_udd_copy_begin(udd->frame, size);
+    start = ktime_get();
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
-    ret = udd_buf_copy(tr, src, fb, rect, swap, fmtcnv_state);
+    ret = udd_buf_copy(udd->tx_buf, src, fb, rect, swap, fmtcnv_state);
 #else
-    ret = udd_buf_copy(tr, src, fb, rect, swap);
+    ret = udd_buf_copy(udd->tx_buf, src, fb, rect, swap);
 #endif
+    udd_stat_hist(udd, UDD_HIST_COPY, udd_stat_us(start));
+    trace_udd_copy_end(udd->frame, size);
     if (ret) {
         pr_info("%s, error on buf copy!\n", __func__);
+        udd_tiles_invalidate(udd);
+        return;
     }
-    // tr = src->vaddr;
-
-    jpeg_data = jpeg_encode_rgb565(tr,
-                                480 * 320, &jpeg_length);
-
-    pr_info("%s, len : %ld\n", __func__, jpeg_length);
-    if (jpeg_length > USB_TRANS_MAX_SIZE)
-        // goto skip_frame;
-        jpeg_length = USB_TRANS_MAX_SIZE - 1;
 
-    udd_flush(udd->udev, jpeg_data, jpeg_length);
-// skip_frame:
-    kfree(jpeg_data);
+    udd_fb_send(udd, fb, udd->tx_buf, drm_rect_width(rect) * fb->format->cpp[0],
+                rect);
 }
 
-static void udd_drm_pipe_update(struct drm_simple_display_pipe *pipe,
-                                struct drm_plane_state *old_state)
+/*
+ * The encoder works on whole MCUs, grow the damage to the 16x16 grid so
+ * the device can composite the decoded block in place.
+ */
+static void udd_damage_align(struct drm_rect *rect, struct drm_framebuffer *fb)
 {
-    struct drm_plane_state *state = pipe->plane.state;
-    struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(state);
-    struct drm_framebuffer *fb = state->fb;
-    struct drm_rect rect, full_rect;
-    int idx;
+    struct udd *udd = drm_to_udd(fb->dev);
 
-    if (!pipe->crtc.state->active)
+    /* the device only takes whole frames */
+    if (!(udd->caps.features & UDD_FEAT_REGION)) {
+        drm_rect_init(rect, 0, 0, fb->width, fb->height);
         return;
+    }
 
-    if (WARN_ON(!fb))
-        return;
+    rect->x1 = round_down(rect->x1, UDD_MCU_SIZE);
+    rect->y1 = round_down(rect->y1, UDD_MCU_SIZE);
+    rect->x2 = min_t(int, round_up(rect->x2, UDD_MCU_SIZE), fb->width);
+    rect->y2 = min_t(int, round_up(rect->y2, UDD_MCU_SIZE), fb->height);
+}
 
-    if (!drm_dev_enter(fb->dev, &idx))
-        return;
+/* Complete a flip: on the next vblank tick, or now if vblank is off */
+static void udd_drm_send_event(struct drm_crtc *crtc,
+                               struct drm_pending_vblank_event *event)
+{
+    spin_lock_irq(&crtc->dev->event_lock);
+    if (drm_crtc_vblank_get(crtc) == 0)
+        drm_crtc_arm_vblank_event(crtc, event);
+    else
+        drm_crtc_send_vblank_event(crtc, event);
+    spin_unlock_irq(&crtc->dev->event_lock);
+}
+
+/*
+ * Transmit worker, takes whatever the mailbox holds: the newest
+ * framebuffer with the damage of every commit since the last send.
+ */
+static void udd_drm_fb_work(struct work_struct *work)
+{
+    struct udd *udd = container_of(work, struct udd, fb_work);
+    struct iosys_map map[DRM_FORMAT_MAX_PLANES], data[DRM_FORMAT_MAX_PLANES];
+    struct drm_pending_vblank_event *event;
+    struct drm_framebuffer *fb;
+    struct drm_rect rect;
+    int idx;
 
-    // NOTE: use full refresh temporarily
-    full_rect.x1 = 0;
-    full_rect.y1 = 0;
-    full_rect.x2 = 480;
-    full_rect.y2 = 320;
+    spin_lock(&udd->fb_lock);
+    fb = udd->fb_pending;
+    rect = udd->fb_damage;
+    udd->frame = udd->fb_frame;
+    event = udd->fb_event;
+    udd->fb_pending = NULL;
+    udd->fb_event = NULL;
+    spin_unlock(&udd->fb_lock);
+
+    if (fb) {
+        /* a frame the hashes counted on went missing, send it all */
+        if (udd_tx_lost(udd)) {
+            udd_tiles_invalidate(udd);
+            drm_rect_init(&rect, 0, 0, fb->width, fb->height);
+        }
 
-    pr_info("%s\n", __func__);
-    if (drm_atomic_helper_damage_merged(old_state, state, &rect)) {
-        pr_info("x1: %u, y1: %u, x2: %u, y2: %u\n", rect.x1, rect.y1, rect.x2, rect.y2);
+        if (drm_dev_enter(fb->dev, &idx)) {
+            if (!drm_gem_fb_vmap(fb, map, data)) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
-        udd_fb_dirty(&shadow_plane_state->data[0], fb, &full_rect,
-                    &shadow_plane_state->fmtcnv_state);
+                udd_fb_dirty(&data[0], fb, &rect, &udd->fmtcnv_state);
 #else
-        udd_fb_dirty(&shadow_plane_state->data[0], fb, &full_rect);
+                udd_fb_dirty(&data[0], fb, &rect);
 #endif
+                drm_gem_fb_vunmap(fb, map);
+            } else {
+                udd_tiles_invalidate(udd);
+            }
+            drm_dev_exit(idx);
+        }
+        drm_framebuffer_put(fb);
     }
 
-    drm_dev_exit(idx);
+    /* the frame has been queued to USB, let the flip complete */
+    if (event)
+        udd_drm_send_event(&udd->pipe.crtc, event);
 }
 
-static int udd_drm_pipe_begin_fb_access(struct drm_simple_display_pipe *pipe,
-				  struct drm_plane_state *plane_state)
+/*
+ * Commits only post to a single slot mailbox and leave encoding to
+ * udd_drm_fb_work(). When the link falls behind, frames that were never
+ * sent are replaced by the newest one with their damage merged, instead
+ * of queueing up behind the commit.
+ */
+static void udd_drm_pipe_update(struct drm_simple_display_pipe *pipe,
+                                struct drm_plane_state *old_state)
 {
-    return drm_gem_begin_shadow_fb_access(&pipe->plane, plane_state);
-}
+    struct udd *udd = drm_to_udd(pipe->crtc.dev);
+    struct drm_plane_state *state = pipe->plane.state;
+    struct drm_pending_vblank_event *event, *stale = NULL;
+    struct drm_crtc *crtc = &pipe->crtc;
+    struct drm_framebuffer *fb = state->fb, *old = NULL;
+    struct drm_rect rect;
+    bool damage;
+    u32 frame;
+
+    event = crtc->state->event;
+    crtc->state->event = NULL;
+
+    if (!crtc->state->active || WARN_ON(!fb)) {
+        if (event)
+            udd_drm_send_event(crtc, event);
+        return;
+    }
 
-static void udd_drm_pipe_end_fb_access(struct drm_simple_display_pipe *pipe,
-				 struct drm_plane_state *plane_state)
-{
-	drm_gem_end_shadow_fb_access(&pipe->plane, plane_state);
-}
+    frame = ++udd->fb_updates;
+    trace_udd_update(frame);
 
-static void udd_drm_pipe_reset_plane(struct drm_simple_display_pipe *pipe)
-{
-	drm_gem_reset_shadow_plane(&pipe->plane);
-}
+    damage = drm_atomic_helper_damage_merged(old_state, state, &rect);
+    if (damage) {
+        udd_damage_align(&rect, fb);
+        trace_udd_damage(frame, rect.x1, rect.y1, rect.x2, rect.y2);
+    }
 
-static struct drm_plane_state *udd_drm_pipe_duplicate_plane_state(struct drm_simple_display_pipe *pipe)
-{
-	return drm_gem_duplicate_shadow_plane_state(&pipe->plane);
-}
+    spin_lock(&udd->fb_lock);
+    if (damage) {
+        if (udd->fb_pending) {
+            udd->fb_damage.x1 = min(udd->fb_damage.x1, rect.x1);
+            udd->fb_damage.y1 = min(udd->fb_damage.y1, rect.y1);
+            udd->fb_damage.x2 = max(udd->fb_damage.x2, rect.x2);
+            udd->fb_damage.y2 = max(udd->fb_damage.y2, rect.y2);
+        } else {
+            udd->fb_damage = rect;
+        }
+        udd->fb_frame = frame;
+        if (udd->fb_pending != fb) {
+            drm_framebuffer_get(fb);
+            old = udd->fb_pending;
+            udd->fb_pending = fb;
+        }
+    }
+    if (event) {
+        stale = udd->fb_event;
+        udd->fb_event = event;
+    }
+    spin_unlock(&udd->fb_lock);
 
-static void udd_drm_pipe_destroy_plane_state(struct drm_simple_display_pipe *pipe,
-				       struct drm_plane_state *plane_state)
-{
-	drm_gem_destroy_shadow_plane_state(&pipe->plane, plane_state);
+    if (old)
+        drm_framebuffer_put(old);
+    /* a replaced frame is never shown, its flip completes as it is */
+    if (stale)
+        udd_drm_send_event(crtc, stale);
+
+    if (damage || event)
+        queue_work(system_highpri_wq, &udd->fb_work);
 }
 
 static const struct drm_simple_display_pipe_funcs udd_display_pipe_funcs = {
@@ -226,11 +508,8 @@ static const struct drm_simple_display_pipe_funcs udd_display_pipe_funcs = {
     .enable = udd_drm_pipe_enable,
     .disable = udd_drm_pipe_disable,
     .update = udd_drm_pipe_update,
-    .begin_fb_access = udd_drm_pipe_begin_fb_access,
-    .end_fb_access = udd_drm_pipe_end_fb_access,
-    .reset_plane = udd_drm_pipe_reset_plane,
-    .duplicate_plane_state = udd_drm_pipe_duplicate_plane_state,
-    .destroy_plane_state = udd_drm_pipe_destroy_plane_state,
+    .enable_vblank = udd_drm_pipe_enable_vblank,
+    .disable_vblank = udd_drm_pipe_disable_vblank,
 };
 
 static int udd_connector_get_modes(struct drm_connector *connector)
@@ -263,15 +542,112 @@ static const uint32_t udd_drm_formats[] = {
     DRM_FORMAT_XRGB8888,
 };
 
-static const struct drm_display_mode udd_disp_mode = {
-    DRM_MODE_INIT(60, 480, 320, 85, 55),
+DEFINE_DRM_GEM_DMA_FOPS(udd_drm_fops);
+
+/*
+ * Cached buffers shared through dma-buf. The CPU and the importing device
+ * do not see each other's writes on their own. An importer gets the buffer
+ * cleaned when it maps it and invalidated when it unmaps it. CPU access
+ * through the dma-buf is bracketed by DMA_BUF_IOCTL_SYNC.
+ */
+static struct sg_table *udd_dmabuf_map(struct dma_buf_attachment *attach,
+                                       enum dma_data_direction dir)
+{
+    struct sg_table *sgt = drm_gem_map_dma_buf(attach, dir);
+
+    if (!IS_ERR(sgt))
+        dma_sync_sgtable_for_device(attach->dev, sgt, dir);
+
+    return sgt;
+}
+
+static void udd_dmabuf_unmap(struct dma_buf_attachment *attach,
+                             struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_sync_sgtable_for_cpu(attach->dev, sgt, dir);
+    drm_gem_unmap_dma_buf(attach, sgt, dir);
+}
+
+static int udd_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+                                       enum dma_data_direction dir)
+{
+    struct drm_gem_object *gem = dmabuf->priv;
+
+    dma_sync_single_for_cpu(gem->dev->dev, to_drm_gem_dma_obj(gem)->dma_addr,
+                            gem->size, dir);
+    return 0;
+}
+
+static int udd_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+                                     enum dma_data_direction dir)
+{
+    struct drm_gem_object *gem = dmabuf->priv;
+
+    dma_sync_single_for_device(gem->dev->dev, to_drm_gem_dma_obj(gem)->dma_addr,
+                               gem->size, dir);
+    return 0;
+}
+
+static const struct dma_buf_ops udd_dmabuf_ops = {
+    .attach = drm_gem_map_attach,
+    .detach = drm_gem_map_detach,
+    .map_dma_buf = udd_dmabuf_map,
+    .unmap_dma_buf = udd_dmabuf_unmap,
+    .release = drm_gem_dmabuf_release,
+    .mmap = drm_gem_dmabuf_mmap,
+    .vmap = drm_gem_dmabuf_vmap,
+    .vunmap = drm_gem_dmabuf_vunmap,
+    .begin_cpu_access = udd_dmabuf_begin_cpu_access,
+    .end_cpu_access = udd_dmabuf_end_cpu_access,
 };
 
-DEFINE_DRM_GEM_DMA_FOPS(udd_drm_fops);
+static struct dma_buf *udd_gem_prime_export(struct drm_gem_object *gem, int flags)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+    exp_info.exp_name = KBUILD_MODNAME;
+    exp_info.owner = gem->dev->driver->fops->owner;
+    exp_info.ops = &udd_dmabuf_ops;
+    exp_info.size = gem->size;
+    exp_info.flags = flags;
+    exp_info.priv = gem;
+    exp_info.resv = gem->resv;
+
+    return drm_gem_dmabuf_export(gem->dev, &exp_info);
+}
+
+/* As the DMA GEM helpers' own, but exported with the ops above */
+static const struct drm_gem_object_funcs udd_gem_cached_funcs = {
+    .free = drm_gem_dma_object_free,
+    .print_info = drm_gem_dma_object_print_info,
+    .export = udd_gem_prime_export,
+    .get_sg_table = drm_gem_dma_object_get_sg_table,
+    .vmap = drm_gem_dma_object_vmap,
+    .mmap = drm_gem_dma_object_mmap,
+    .vm_ops = &drm_gem_dma_vm_ops,
+};
+
+static struct drm_gem_object *udd_drm_gem_create_object(struct drm_device *drm,
+                                                        size_t size)
+{
+    struct drm_gem_dma_object *dma_obj;
+
+    dma_obj = kzalloc(sizeof(*dma_obj), GFP_KERNEL);
+    if (!dma_obj)
+        return ERR_PTR(-ENOMEM);
+
+    /* dma_alloc_noncoherent(), mapped cached in the kernel and by mmap */
+    dma_obj->map_noncoherent = cached_fb;
+    if (cached_fb)
+        dma_obj->base.funcs = &udd_gem_cached_funcs;
+
+    return &dma_obj->base;
+}
 
 static const struct drm_driver udd_drm_driver = {
     .driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
     .fops = &udd_drm_fops,
+    .gem_create_object = udd_drm_gem_create_object,
     DRM_GEM_DMA_DRIVER_OPS_VMAP,
     .name = "udd-drm",
     .desc = "UDD DRM driver",
@@ -280,6 +656,11 @@ static const struct drm_driver udd_drm_driver = {
     .minor = 0,
 };
 
+static void udd_drm_free_tx_buf(void *buf)
+{
+    kvfree(buf);
+}
+
 static int udd_drm_dev_init_with_formats(struct udd *udd,
                 const struct drm_simple_display_pipe_funcs *funcs,
                 const uint32_t *formats, unsigned int formats_count,
@@ -300,9 +681,32 @@ static int udd_drm_dev_init_with_formats(struct udd *udd,
         return rc;
     }
 
-    udd->tx_buf = devm_kmalloc(drm->dev, tx_buf_size, GFP_KERNEL);
+    spin_lock_init(&udd->fb_lock);
+    INIT_WORK(&udd->fb_work, udd_drm_fb_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    drm_format_conv_state_init(&udd->fmtcnv_state);
+#endif
+
+    rc = drm_vblank_init(drm, 1);
+    if (rc) {
+        pr_err("failed to init vblank\n");
+        return rc;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&udd->vblank_timer, udd_vblank_timer_fn, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&udd->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    udd->vblank_timer.function = udd_vblank_timer_fn;
+#endif
+
+    /* a whole frame, too big to ask for contiguous */
+    udd->tx_buf = kvmalloc(tx_buf_size, GFP_KERNEL);
     if (!udd->tx_buf)
         return -ENOMEM;
+    rc = devm_add_action_or_reset(drm->dev, udd_drm_free_tx_buf, udd->tx_buf);
+    if (rc)
+        return rc;
 
     drm_mode_copy(&udd->mode, mode);
     pr_info("mode: %ux%u\n", udd->mode.hdisplay, udd->mode.vdisplay);
@@ -339,7 +743,8 @@ static int udd_drm_dev_init(struct udd *udd,
                 const struct drm_simple_display_pipe_funcs *funcs,
                 const struct drm_display_mode *mode)
 {
-    ssize_t bufsize = mode->vdisplay * mode->hdisplay * sizeof(u16);
+    /* room for the damage packed in the widest format, XRGB8888 */
+    ssize_t bufsize = mode->vdisplay * mode->hdisplay * sizeof(u32);
 
     udd->drm.mode_config.preferred_depth = 16;
 
@@ -349,8 +754,13 @@ static int udd_drm_dev_init(struct udd *udd,
                         ARRAY_SIZE(udd_drm_formats), mode, bufsize);
 }
 
-struct drm_device *udd_drm_alloc(struct device *dev)
+struct drm_device *udd_drm_alloc(struct device *dev,
+                                 const struct udd_display *display)
 {
+    struct drm_display_mode mode = {
+        DRM_MODE_INIT(display->fps, display->xres, display->yres,
+                      display->width_mm, display->height_mm),
+    };
     struct udd *udd;
     struct drm_device *drm;
     int rc;
@@ -368,7 +778,7 @@ struct drm_device *udd_drm_alloc(struct device *dev)
     dev->dma_mask = &udd->dma_mask;
     dev->coherent_dma_mask = udd->dma_mask;
 
-    rc = udd_drm_dev_init(udd, &udd_display_pipe_funcs, &udd_disp_mode);
+    rc = udd_drm_dev_init(udd, &udd_display_pipe_funcs, &mode);
     if (rc) {
         pr_err("failed to init drm dev\n");
         return ERR_PTR(-ENOMEM);
@@ -403,7 +813,17 @@ int udd_drm_register(struct drm_device *drm)
 
 void udd_drm_unregister(struct drm_device *drm)
 {
+    struct udd *udd = drm_to_udd(drm);
+
     pr_info("%s\n", __func__);
     drm_dev_unplug(drm);
     drm_atomic_helper_shutdown(drm);
+    cancel_work_sync(&udd->fb_work);
+    if (udd->fb_pending)
+        drm_framebuffer_put(udd->fb_pending);
+    udd->fb_pending = NULL;
+    hrtimer_cancel(&udd->vblank_timer);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    drm_format_conv_state_release(&udd->fmtcnv_state);
+#endif
 }
@@ -0,0 +1,66 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Put udd-emu on the dummy_hcd loopback as 2E8A:0001, so the driver binds
+# to it like to the real board. Arguments go to udd-emu, e.g.
+#
+#   sudo ./gadget.sh -p 2 -b 4 -r 4000000
+#
+# Stop it with Ctrl-C, the gadget is taken down again.
+
+set -e
+
+EMU_DIR=$(dirname "$(readlink -f "$0")")
+GADGET=/sys/kernel/config/usb_gadget/udd
+FFS=/dev/ffs-udd
+UDC=${UDC:-dummy_udc.0}
+
+cleanup() {
+    trap - EXIT INT TERM
+    [ -e $GADGET/UDC ] && echo "" > $GADGET/UDC 2>/dev/null || true
+    [ -n "$EMU_PID" ] && kill "$EMU_PID" 2>/dev/null && wait "$EMU_PID" || true
+    mountpoint -q $FFS && umount $FFS
+    rmdir $FFS 2>/dev/null || true
+    if [ -d $GADGET ]; then
+        rm -f $GADGET/configs/c.1/ffs.udd
+        rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1 \
+              $GADGET/functions/ffs.udd $GADGET/strings/0x409 $GADGET
+    fi
+}
+
+modprobe libcomposite
+modprobe dummy_hcd
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+trap cleanup EXIT INT TERM
+
+mkdir $GADGET
+echo 0x2e8a > $GADGET/idVendor
+echo 0x0001 > $GADGET/idProduct
+echo 0x0200 > $GADGET/bcdUSB
+mkdir $GADGET/strings/0x409
+echo "embeddedboys" > $GADGET/strings/0x409/manufacturer
+echo "udd emulator" > $GADGET/strings/0x409/product
+echo "0" > $GADGET/strings/0x409/serialnumber
+
+mkdir $GADGET/configs/c.1
+mkdir $GADGET/configs/c.1/strings/0x409
+echo "udd" > $GADGET/configs/c.1/strings/0x409/configuration
+echo 100 > $GADGET/configs/c.1/MaxPower
+mkdir $GADGET/functions/ffs.udd
+ln -s $GADGET/functions/ffs.udd $GADGET/configs/c.1/
+
+mkdir -p $FFS
+mount -t functionfs udd $FFS
+
+"$EMU_DIR/udd-emu" "$@" $FFS &
+EMU_PID=$!
+
+# the endpoint files show up once udd-emu has written its descriptors
+while [ ! -e $FFS/ep2 ]; do
+    kill -0 $EMU_PID 2>/dev/null || exit 1
+    sleep 0.1
+done
+echo $UDC > $GADGET/UDC
+
+wait $EMU_PID
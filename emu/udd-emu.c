@@ -0,0 +1,916 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Userspace stand-in for the RP2350 display board, on FunctionFS. Bound
+ * to dummy_hcd by gadget.sh it enumerates as 2E8A:0001, and the driver
+ * drives it like the real board: capability descriptor on EP0, frame
+ * headers on EP0 or in-band, JPEGs on the bulk OUT endpoint and status
+ * reports on the interrupt IN endpoint. Frames are decoded with libjpeg
+ * when it is available, and decoding can be slowed down to a given rate
+ * to look like the real device.
+ *
+ * Copyright (C) 2025 embeddedboys, Ltd.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+#endif
+
+/* The device side of usb.c, keep the two in sync */
+#define REQ_EP0_IN      0x01
+#define REQ_EP1_OUT     0x02
+
+#define UDD_CMD_FRAME   0x51
+#define UDD_CMD_REGION  0x52
+#define UDD_CMD_TILES   0x53
+
+#define UDD_DESC_CAPS   0x01
+
+#define UDD_CODEC_JPEG      (1 << 0)
+#define UDD_FEAT_REGION     (1 << 0)
+#define UDD_FEAT_TILES      (1 << 1)
+#define UDD_FEAT_CREDITS    (1 << 2)
+
+#define UDD_PROTO_INBAND    2
+#define UDD_STATUS_CREDITS  0x01
+#define UDD_MCU_SIZE        16
+
+struct udd_caps_desc {
+    uint8_t  bLength;
+    uint8_t  bVersion;
+    uint16_t wWidth;
+    uint16_t wHeight;
+    uint16_t wWidthMm;
+    uint16_t wHeightMm;
+    uint8_t  bFps;
+    uint8_t  bBuffers;
+    uint16_t wCodecs;
+    uint16_t wFeatures;
+    uint32_t dwMaxTransfer;
+    uint32_t dwDecodeRate;
+} __attribute__((packed));
+
+struct udd_bulk_hdr {
+    uint8_t  bCmd;
+    uint8_t  bSeq;
+    uint16_t wReserved;
+    uint32_t dwLength;
+    uint32_t dwOffset;
+    uint32_t dwTotal;
+    uint16_t wParam[4];
+} __attribute__((packed));
+
+struct udd_status {
+    uint8_t  bType;
+    uint8_t  bFree;
+    uint8_t  bSeq;
+    uint8_t  bDoneSeq;
+    uint32_t dwDecodeUs;
+} __attribute__((packed));
+
+/* htole*() is no constant expression, the static descriptors need one */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)  (x)
+#define cpu_to_le32(x)  (x)
+#else
+#define cpu_to_le16(x)  ((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x)  ((((x) & 0xff000000u) >> 24) | \
+                         (((x) & 0x00ff0000u) >> 8) | \
+                         (((x) & 0x0000ff00u) << 8) | \
+                         (((x) & 0x000000ffu) << 24))
+#endif
+
+#define EMU_MAX_BUFFERS 16
+#define EMU_MAX_HEADERS 16
+
+static int opt_proto = 1;
+static int opt_width = 480, opt_height = 320, opt_fps = 24;
+static int opt_buffers;
+static uint32_t opt_max_transfer = 40000;
+static uint32_t opt_rate;
+static bool opt_decode = true;
+static const char *opt_dump;
+
+static int ep0 = -1, ep_out = -1, ep_status = -1;
+static volatile sig_atomic_t quit;
+
+/* A frame as the device holds it until it is shown */
+struct emu_frame {
+    uint8_t  cmd;
+    uint8_t  seq;
+    uint16_t param[4];
+    uint8_t  *data;
+    size_t   len;
+    size_t   size;
+};
+
+static struct emu_frame frames[EMU_MAX_BUFFERS];
+static int nbuffers;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int free_list[EMU_MAX_BUFFERS], nfree;
+static int ready[EMU_MAX_BUFFERS], ready_head, nready;
+
+/* Protocol 1 headers from EP0, waiting for their payload */
+static uint8_t headers[EMU_MAX_HEADERS][12];
+static int header_head, nheaders;
+
+/* What the next status report says */
+static struct udd_status status = {
+    .bType = UDD_STATUS_CREDITS, .bSeq = 0xff, .bDoneSeq = 0xff,
+};
+static bool status_dirty;
+
+/* Shown image, RGB888 */
+static uint8_t *screen;
+
+static struct {
+    uint64_t frames, bytes, errors, decode_us;
+} stats;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * FunctionFS descriptors: one vendor interface with the bulk OUT the
+ * frames arrive on and the interrupt IN for status reports. Vendor
+ * requests to the device itself must reach us, hence ALL_CTRL_RECIP.
+ */
+struct emu_descs {
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio out;
+    struct usb_endpoint_descriptor_no_audio status;
+} __attribute__((packed));
+
+static const struct {
+    struct usb_functionfs_descs_head_v2 header;
+    uint32_t fs_count;
+    uint32_t hs_count;
+    struct emu_descs fs, hs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC |
+                         FUNCTIONFS_ALL_CTRL_RECIP),
+        .length = cpu_to_le32(sizeof(descriptors)),
+    },
+    .fs_count = cpu_to_le32(3),
+    .hs_count = cpu_to_le32(3),
+#define EMU_DESCS(maxp, interval) {                                         \
+        .intf = {                                                           \
+            .bLength = sizeof(struct usb_interface_descriptor),             \
+            .bDescriptorType = USB_DT_INTERFACE,                            \
+            .bNumEndpoints = 2,                                             \
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,                       \
+            .iInterface = 1,                                                \
+        },                                                                  \
+        .out = {                                                            \
+            .bLength = sizeof(struct usb_endpoint_descriptor_no_audio),     \
+            .bDescriptorType = USB_DT_ENDPOINT,                             \
+            .bEndpointAddress = 1 | USB_DIR_OUT,                            \
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,                         \
+            .wMaxPacketSize = cpu_to_le16(maxp),                                \
+        },                                                                  \
+        .status = {                                                         \
+            .bLength = sizeof(struct usb_endpoint_descriptor_no_audio),     \
+            .bDescriptorType = USB_DT_ENDPOINT,                             \
+            .bEndpointAddress = 2 | USB_DIR_IN,                             \
+            .bmAttributes = USB_ENDPOINT_XFER_INT,                          \
+            .wMaxPacketSize = cpu_to_le16(sizeof(struct udd_status)),           \
+            .bInterval = interval,                                          \
+        },                                                                  \
+    }
+    .fs = EMU_DESCS(64, 1),
+    .hs = EMU_DESCS(512, 4),
+#undef EMU_DESCS
+};
+
+#define EMU_STR "udd emulator"
+
+static const struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        uint16_t code;
+        char str[sizeof(EMU_STR)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = cpu_to_le32(sizeof(strings)),
+        .str_count = cpu_to_le32(1),
+        .lang_count = cpu_to_le32(1),
+    },
+    .lang0 = { cpu_to_le16(0x0409), EMU_STR },
+};
+
+static void build_caps(struct udd_caps_desc *caps)
+{
+    uint16_t features = UDD_FEAT_REGION | UDD_FEAT_TILES;
+
+    if (opt_buffers)
+        features |= UDD_FEAT_CREDITS;
+
+    memset(caps, 0, sizeof(*caps));
+    caps->bLength = sizeof(*caps);
+    caps->bVersion = opt_proto;
+    caps->wWidth = htole16(opt_width);
+    caps->wHeight = htole16(opt_height);
+    caps->bFps = opt_fps;
+    caps->bBuffers = opt_buffers;
+    caps->wCodecs = htole16(UDD_CODEC_JPEG);
+    caps->wFeatures = htole16(features);
+    caps->dwMaxTransfer = htole32(opt_max_transfer);
+    caps->dwDecodeRate = htole32(opt_rate);
+}
+
+/* Tell the host what changed, if it listens for status reports */
+static void status_update(void)
+{
+    status.bFree = nfree;
+    status_dirty = true;
+    pthread_cond_broadcast(&cond);
+}
+
+static void *status_thread(void *arg)
+{
+    struct udd_status report;
+    ssize_t ret;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!status_dirty && !quit)
+            pthread_cond_wait(&cond, &lock);
+        report = status;
+        status_dirty = false;
+        pthread_mutex_unlock(&lock);
+        if (quit)
+            break;
+
+        ret = write(ep_status, &report, sizeof(report));
+        if (ret < 0 && errno != ESHUTDOWN && errno != EINTR)
+            perror("status");
+    }
+
+    return NULL;
+}
+
+static int take_free_buffer(void)
+{
+    int idx;
+
+    pthread_mutex_lock(&lock);
+    while (!nfree && !quit)
+        pthread_cond_wait(&cond, &lock);
+    idx = nfree ? free_list[--nfree] : -1;
+    pthread_mutex_unlock(&lock);
+
+    return idx;
+}
+
+static void give_free_buffer(int idx)
+{
+    pthread_mutex_lock(&lock);
+    free_list[nfree++] = idx;
+    status_update();
+    pthread_mutex_unlock(&lock);
+}
+
+static void frame_received(int idx)
+{
+    pthread_mutex_lock(&lock);
+    ready[(ready_head + nready++) % EMU_MAX_BUFFERS] = idx;
+    status.bSeq = frames[idx].seq;
+    status_update();
+    pthread_mutex_unlock(&lock);
+}
+
+static int frame_reserve(struct emu_frame *frame, size_t size)
+{
+    uint8_t *data;
+
+    if (size <= frame->size)
+        return 0;
+    data = realloc(frame->data, size);
+    if (!data)
+        return -ENOMEM;
+    frame->data = data;
+    frame->size = size;
+    return 0;
+}
+
+/* Read exactly len bytes of payload, transfer by transfer */
+static int read_payload(uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t ret;
+
+    while (got < len) {
+        ret = read(ep_out, buf + got, len - got);
+        if (ret < 0) {
+            if (errno == EINTR && !quit)
+                continue;
+            return -errno;
+        }
+        got += ret;
+    }
+
+    return 0;
+}
+
+/* Protocol 1: the header came on EP0, the payload follows on bulk OUT */
+static int receive_ep0_framed(int idx)
+{
+    struct emu_frame *frame = &frames[idx];
+    uint8_t *hdr;
+    int i, rc;
+
+    pthread_mutex_lock(&lock);
+    while (!nheaders && !quit)
+        pthread_cond_wait(&cond, &lock);
+    if (quit) {
+        pthread_mutex_unlock(&lock);
+        return -EINTR;
+    }
+    hdr = headers[header_head];
+    frame->cmd = hdr[0];
+    frame->len = hdr[1] | hdr[2] << 8;
+    frame->seq = hdr[3];
+    for (i = 0; i < 4; i++)
+        frame->param[i] = hdr[4 + 2 * i] | hdr[5 + 2 * i] << 8;
+    header_head = (header_head + 1) % EMU_MAX_HEADERS;
+    nheaders--;
+    pthread_mutex_unlock(&lock);
+
+    rc = frame_reserve(frame, frame->len);
+    if (rc)
+        return rc;
+    return read_payload(frame->data, frame->len);
+}
+
+/* Protocol 2: every transfer starts with a header, large frames in parts */
+static int receive_inband(int idx, uint8_t *xfer, size_t xfer_size)
+{
+    struct emu_frame *frame = &frames[idx];
+    struct udd_bulk_hdr *hdr = (struct udd_bulk_hdr *)xfer;
+    uint32_t length, offset, total;
+    size_t received = 0;
+    ssize_t ret;
+    int i;
+
+    for (;;) {
+        ret = read(ep_out, xfer, xfer_size);
+        if (ret < 0) {
+            if (errno == EINTR && !quit)
+                continue;
+            return -errno;
+        }
+        if ((size_t)ret < sizeof(*hdr)) {
+            stats.errors++;
+            continue;
+        }
+
+        length = le32toh(hdr->dwLength);
+        offset = le32toh(hdr->dwOffset);
+        total = le32toh(hdr->dwTotal);
+        if (length > ret - sizeof(*hdr) || offset + length > total) {
+            stats.errors++;
+            received = 0;
+            continue;
+        }
+
+        /* a new frame, or a part missing: start over from this one */
+        if (offset != received) {
+            if (offset) {
+                stats.errors++;
+                received = 0;
+                continue;
+            }
+            received = 0;
+        }
+        if (!offset) {
+            frame->cmd = hdr->bCmd;
+            frame->seq = hdr->bSeq;
+            frame->len = total;
+            for (i = 0; i < 4; i++)
+                frame->param[i] = le16toh(hdr->wParam[i]);
+            if (frame_reserve(frame, total))
+                return -ENOMEM;
+        }
+
+        memcpy(frame->data + offset, xfer + sizeof(*hdr), length);
+        received += length;
+        if (received == frame->len)
+            return 0;
+    }
+}
+
+static void *receive_thread(void *arg)
+{
+    size_t xfer_size = sizeof(struct udd_bulk_hdr) + opt_max_transfer;
+    uint8_t *xfer = NULL;
+    int idx, rc;
+
+    if (opt_proto >= UDD_PROTO_INBAND) {
+        xfer = malloc(xfer_size);
+        if (!xfer)
+            return NULL;
+    }
+
+    while (!quit) {
+        /* no free buffer, the host is held off with NAKs */
+        idx = take_free_buffer();
+        if (idx < 0)
+            break;
+
+        if (opt_proto >= UDD_PROTO_INBAND)
+            rc = receive_inband(idx, xfer, xfer_size);
+        else
+            rc = receive_ep0_framed(idx);
+        if (rc) {
+            give_free_buffer(idx);
+            if (rc != -ESHUTDOWN && rc != -EINTR) {
+                fprintf(stderr, "receive: %s\n", strerror(-rc));
+                stats.errors++;
+            }
+            continue;
+        }
+
+        frame_received(idx);
+    }
+
+    free(xfer);
+    return NULL;
+}
+
+/* Copy w x h pixels of src, pitch bytes apart, to the screen at x, y */
+static void blit(const uint8_t *src, int pitch, int x, int y, int w, int h)
+{
+    int line;
+
+    if (x >= opt_width || y >= opt_height)
+        return;
+    if (x + w > opt_width)
+        w = opt_width - x;
+    if (y + h > opt_height)
+        h = opt_height - y;
+
+    for (line = 0; line < h; line++)
+        memcpy(&screen[((y + line) * opt_width + x) * 3],
+               &src[line * pitch], w * 3);
+}
+
+#ifdef HAVE_LIBJPEG
+struct emu_jpeg_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void emu_jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct emu_jpeg_error *)cinfo->err)->jmp, 1);
+}
+
+/* Decode a JPEG to RGB888, the caller frees *rgb */
+static int decode_jpeg(const uint8_t *data, size_t len, uint8_t **rgb,
+                       int *width, int *height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct emu_jpeg_error err;
+    JSAMPROW row;
+
+    *rgb = NULL;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = emu_jpeg_error_exit;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(*rgb);
+        *rgb = NULL;
+        return -EINVAL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *rgb = malloc((size_t)*width * *height * 3);
+    if (!*rgb) {
+        jpeg_destroy_decompress(&cinfo);
+        return -ENOMEM;
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = *rgb + (size_t)cinfo.output_scanline * *width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
+#else
+/* Without libjpeg only check that it looks like a whole JPEG */
+static int decode_jpeg(const uint8_t *data, size_t len, uint8_t **rgb,
+                       int *width, int *height)
+{
+    size_t i;
+
+    *rgb = NULL;
+    if (len < 4 || data[0] != 0xff || data[1] != 0xd8)
+        return -EINVAL;
+    /* the host pads odd lengths with a zero */
+    if (!data[len - 1])
+        len--;
+    if (data[len - 2] != 0xff || data[len - 1] != 0xd9)
+        return -EINVAL;
+
+    for (i = 2; i + 8 < len; i++) {
+        if (data[i] == 0xff && data[i + 1] == 0xc0) {
+            *height = data[i + 5] << 8 | data[i + 6];
+            *width = data[i + 7] << 8 | data[i + 8];
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+#endif
+
+static int show_frame(struct emu_frame *frame)
+{
+    int cols = (opt_width + UDD_MCU_SIZE - 1) / UDD_MCU_SIZE;
+    const uint8_t *jpeg = frame->data;
+    size_t len = frame->len;
+    int width, height, i, idx, count = 0, per_line = 1;
+    uint8_t *rgb;
+    int rc;
+
+    if (frame->cmd == UDD_CMD_TILES) {
+        count = frame->param[0];
+        per_line = frame->param[1];
+        if (!per_line || count * 2 > len)
+            return -EINVAL;
+        jpeg += count * 2;
+        len -= count * 2;
+    }
+
+    rc = decode_jpeg(jpeg, len, &rgb, &width, &height);
+    if (rc || !rgb)
+        return rc;
+
+    switch (frame->cmd) {
+    case UDD_CMD_FRAME:
+        blit(rgb, width * 3, 0, 0, width, height);
+        break;
+    case UDD_CMD_REGION:
+        blit(rgb, width * 3, frame->param[0], frame->param[1],
+             frame->param[2], frame->param[3]);
+        break;
+    case UDD_CMD_TILES:
+        for (i = 0; i < count; i++) {
+            idx = frame->data[2 * i] | frame->data[2 * i + 1] << 8;
+            blit(&rgb[((i / per_line) * UDD_MCU_SIZE * width +
+                       (i % per_line) * UDD_MCU_SIZE) * 3],
+                 width * 3, (idx % cols) * UDD_MCU_SIZE,
+                 (idx / cols) * UDD_MCU_SIZE, UDD_MCU_SIZE, UDD_MCU_SIZE);
+        }
+        break;
+    default:
+        rc = -EINVAL;
+    }
+
+    free(rgb);
+    return rc;
+}
+
+/* Pixels the device decodes for a frame, for the decode rate throttle */
+static uint64_t frame_pixels(const struct emu_frame *frame)
+{
+    switch (frame->cmd) {
+    case UDD_CMD_REGION:
+        return (uint64_t)frame->param[2] * frame->param[3];
+    case UDD_CMD_TILES:
+        return (uint64_t)frame->param[0] * UDD_MCU_SIZE * UDD_MCU_SIZE;
+    default:
+        return (uint64_t)opt_width * opt_height;
+    }
+}
+
+static void *decode_thread(void *arg)
+{
+    struct emu_frame *frame;
+    uint64_t start, want, took;
+    int idx;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!nready && !quit)
+            pthread_cond_wait(&cond, &lock);
+        if (quit) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        idx = ready[ready_head];
+        ready_head = (ready_head + 1) % EMU_MAX_BUFFERS;
+        nready--;
+        pthread_mutex_unlock(&lock);
+
+        frame = &frames[idx];
+        start = now_us();
+        if (opt_decode && show_frame(frame))
+            stats.errors++;
+
+        took = now_us() - start;
+        if (opt_rate) {
+            want = frame_pixels(frame) * 1000000 / opt_rate;
+            if (want > took) {
+                usleep(want - took);
+                took = want;
+            }
+        }
+
+        stats.frames++;
+        stats.bytes += frame->len;
+        stats.decode_us += took;
+
+        pthread_mutex_lock(&lock);
+        status.bDoneSeq = frame->seq;
+        status.dwDecodeUs = htole32(took);
+        free_list[nfree++] = idx;
+        status_update();
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+static void stall(const struct usb_ctrlrequest *setup)
+{
+    ssize_t ret;
+
+    if (setup->bRequestType & USB_DIR_IN)
+        ret = read(ep0, NULL, 0);
+    else
+        ret = write(ep0, NULL, 0);
+    (void)ret;
+}
+
+static void handle_setup(const struct usb_ctrlrequest *setup)
+{
+    uint16_t value = le16toh(setup->wValue);
+    uint16_t length = le16toh(setup->wLength);
+    struct udd_caps_desc caps;
+    uint8_t data[64];
+    ssize_t ret;
+
+    if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR) {
+        stall(setup);
+        return;
+    }
+
+    if (setup->bRequest == REQ_EP0_IN && (setup->bRequestType & USB_DIR_IN) &&
+        value == UDD_DESC_CAPS) {
+        build_caps(&caps);
+        ret = write(ep0, &caps, length < sizeof(caps) ? length : sizeof(caps));
+        if (ret < 0)
+            perror("caps");
+        return;
+    }
+
+    if (setup->bRequest == REQ_EP1_OUT && !(setup->bRequestType & USB_DIR_IN) &&
+        length <= sizeof(data)) {
+        ret = read(ep0, data, length);
+        if (ret < 4)
+            return;
+
+        pthread_mutex_lock(&lock);
+        if (nheaders < EMU_MAX_HEADERS) {
+            memset(headers[(header_head + nheaders) % EMU_MAX_HEADERS], 0, 12);
+            memcpy(headers[(header_head + nheaders) % EMU_MAX_HEADERS], data,
+                   ret < 12 ? ret : 12);
+            nheaders++;
+            pthread_cond_broadcast(&cond);
+        } else {
+            stats.errors++;
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    stall(setup);
+}
+
+static void *stats_thread(void *arg)
+{
+    uint64_t frames0 = 0, bytes0 = 0, us0 = 0;
+
+    while (!quit) {
+        sleep(1);
+        printf("%4llu fps %8.1f KB/s %6.2f ms decode %llu errors\n",
+               (unsigned long long)(stats.frames - frames0),
+               (stats.bytes - bytes0) / 1024.0,
+               stats.frames > frames0 ?
+               (stats.decode_us - us0) / 1000.0 / (stats.frames - frames0) : 0,
+               (unsigned long long)stats.errors);
+        fflush(stdout);
+        frames0 = stats.frames;
+        bytes0 = stats.bytes;
+        us0 = stats.decode_us;
+    }
+
+    return NULL;
+}
+
+static void dump_screen(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        perror(path);
+        return;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", opt_width, opt_height);
+    fwrite(screen, 3, opt_width * opt_height, f);
+    fclose(f);
+}
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static int open_ep(const char *dir, const char *name, int flags)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, flags);
+    if (fd < 0)
+        perror(path);
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-p protocol] [-w width] [-h height] [-f fps] [-b buffers]\n"
+            "          [-m max_transfer] [-r pixels/s] [-n] [-o screen.ppm] ffs-dir\n"
+            "  -p  1: headers on EP0, 2: headers in the bulk stream\n"
+            "  -b  frame buffers, with status reports for credit flow control\n"
+            "      (default: 2 buffers, no status reports)\n"
+            "  -r  decode no faster than this\n"
+            "  -n  do not decode, only count\n"
+            "  -o  write the screen there on exit\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = on_signal };
+    pthread_t rx, dec, st, sts;
+    struct usb_functionfs_event event;
+    const char *dir;
+    ssize_t ret;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:w:h:f:b:m:r:no:")) != -1) {
+        switch (opt) {
+        case 'p':
+            opt_proto = atoi(optarg);
+            break;
+        case 'w':
+            opt_width = atoi(optarg);
+            break;
+        case 'h':
+            opt_height = atoi(optarg);
+            break;
+        case 'f':
+            opt_fps = atoi(optarg);
+            break;
+        case 'b':
+            opt_buffers = atoi(optarg);
+            break;
+        case 'm':
+            opt_max_transfer = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opt_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opt_decode = false;
+            break;
+        case 'o':
+            opt_dump = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || opt_proto < 1 || opt_width <= 0 ||
+        opt_height <= 0 || opt_fps <= 0 || opt_buffers < 0 ||
+        opt_buffers > EMU_MAX_BUFFERS || opt_max_transfer < 64) {
+        usage(argv[0]);
+        return 1;
+    }
+    dir = argv[optind];
+
+    nbuffers = opt_buffers ? opt_buffers : 2;
+    for (i = 0; i < nbuffers; i++)
+        free_list[nfree++] = i;
+    status.bFree = nfree;
+
+    screen = calloc(opt_width * opt_height, 3);
+    if (!screen)
+        return 1;
+
+    ep0 = open_ep(dir, "ep0", O_RDWR);
+    if (ep0 < 0)
+        return 1;
+    if (write(ep0, &descriptors, sizeof(descriptors)) < 0) {
+        perror("descriptors");
+        return 1;
+    }
+    if (write(ep0, &strings, sizeof(strings)) < 0) {
+        perror("strings");
+        return 1;
+    }
+
+    ep_out = open_ep(dir, "ep1", O_RDONLY);
+    ep_status = open_ep(dir, "ep2", O_WRONLY);
+    if (ep_out < 0 || ep_status < 0)
+        return 1;
+
+    /* no SA_RESTART, the ep0 read has to give up on a signal */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_create(&rx, NULL, receive_thread, NULL);
+    pthread_create(&dec, NULL, decode_thread, NULL);
+    pthread_create(&sts, NULL, stats_thread, NULL);
+    if (opt_buffers)
+        pthread_create(&st, NULL, status_thread, NULL);
+
+    printf("%dx%d@%d, protocol %d, %d buffers%s, %u bytes/transfer\n",
+           opt_width, opt_height, opt_fps, opt_proto, nbuffers,
+           opt_buffers ? " with credits" : "", opt_max_transfer);
+
+    while (!quit) {
+        ret = read(ep0, &event, sizeof(event));
+        if (ret < 0) {
+            if (errno == EINTR && !quit)
+                continue;
+            if (errno != EINTR)
+                perror("ep0");
+            break;
+        }
+
+        switch (event.type) {
+        case FUNCTIONFS_SETUP:
+            handle_setup(&event.u.setup);
+            break;
+        case FUNCTIONFS_ENABLE:
+            printf("enabled\n");
+            break;
+        case FUNCTIONFS_DISABLE:
+            printf("disabled\n");
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* wake the threads; the ones blocked on endpoints go with the process */
+    quit = 1;
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    if (opt_dump)
+        dump_screen(opt_dump);
+
+    return 0;
+}
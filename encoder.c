@@ -1,21 +1,488 @@
 #include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
 
 #include "encoder.h"
 #include "jpegenc.h"
-uint8_t *jpeg_encode_bmp(uint8_t *bmp, size_t len, size_t *out_size)
+
+/*
+ * Rate control ladder: quantizer scales in percent of the Annex K tables,
+ * finest first, and the typical compressed size at each scale relative to
+ * 100% (x256, measured on UI, photo and noise frames).
+ */
+static const uint16_t jpeg_rc_scale[] = {
+    25, 35, 50, 70, 100, 140, 200, 280, 400, 560, 800, 1100, 1600
+};
+static const uint16_t jpeg_rc_shape[] = {
+    520, 450, 375, 315, 256, 215, 170, 140, 115, 100, 87, 78, 72
+};
+#define JPEG_RC_STEPS       ARRAY_SIZE(jpeg_rc_scale)
+#define JPEG_RC_DEFAULT     6       /* 200%, the old JPEGE_Q_LOW */
+
+/*
+ * Every MCU row is a restart interval, so a frame can be cut into bands
+ * of whole rows that are encoded on different CPUs and concatenated.
+ */
+#define JPEG_MAX_BANDS      8
+#define JPEG_BAND_MIN_ROWS  2
+
+static bool parallel_encode = true;
+module_param(parallel_encode, bool, 0644);
+MODULE_PARM_DESC(parallel_encode, "Encode bands of MCU rows on all online CPUs");
+
+/*
+ * Huffman tables fitted to the content: the symbols of one frame in
+ * JPEG_HUFF_SAMPLE are counted into a decaying histogram, and the tables
+ * built from it replace the ones in use when they would have coded the
+ * counted symbols in 1/JPEG_HUFF_GAIN fewer bits.
+ */
+#define JPEG_HUFF_SAMPLE    4
+#define JPEG_HUFF_GAIN      32
+
+static bool optimize_huffman;
+module_param(optimize_huffman, bool, 0644);
+MODULE_PARM_DESC(optimize_huffman, "Build Huffman tables from the statistics of recent frames");
+
+struct jpeg_band {
+    struct work_struct work;
+
+    /* private copy of the session tables, predictors and bit writer */
+    JPEGE_IMAGE jpeg;
+    JPEGENCODE jpe;
+
+    uint8_t *buf;
+    size_t size;
+
+    uint8_t *pixels;
+    int pitch;
+    int row, rows;
+    int rc;
+
+    JPEGE_HUFF_STATS huff;
+};
+
+struct jpeg_session {
+    JPEGE_IMAGE jpeg;
+    JPEGENCODE jpe;
+
+    struct workqueue_struct *wq;
+    struct jpeg_band *bands[JPEG_MAX_BANDS];
+
+    /* parameters the cached header and tables were built for */
+    uint8_t pixel_type;
+    uint8_t subsample;
+    int qscale;
+
+    /* bytes per MCU at 100% scale, x16, 0 until the first frame */
+    uint32_t complexity;
+
+    /* symbols of the frame being encoded, and of the recent ones */
+    unsigned int huff_frames;
+    bool huff_sample;
+    JPEGE_HUFF_STATS huff_frame;
+    JPEGE_HUFF_STATS huff_stats;
+    uint8_t huff_spec[4][JPEGE_HUFF_SPEC_SIZE];
+    uint8_t huff_next[4][JPEGE_HUFF_SPEC_SIZE];
+    JPEGE_HUFF_WORK huff_work;
+};
+
+struct jpeg_session *jpeg_session_alloc(void)
+{
+    struct jpeg_session *session;
+
+    session = kzalloc(sizeof(struct jpeg_session), GFP_KERNEL);
+    if (!session)
+        return NULL;
+
+    /* without it every frame is encoded on the calling CPU */
+    session->wq = alloc_workqueue("udd-jpeg", WQ_HIGHPRI, 0);
+
+    return session;
+}
+
+void jpeg_session_free(struct jpeg_session *session)
+{
+    int i;
+
+    if (!session)
+        return;
+
+    if (session->wq)
+        destroy_workqueue(session->wq);
+
+    for (i = 0; i < JPEG_MAX_BANDS; i++) {
+        if (!session->bands[i])
+            continue;
+        kvfree(session->bands[i]->buf);
+        kfree(session->bands[i]);
+    }
+
+    kfree(session);
+}
+
+/*
+ * Point the session at a new output buffer and write the header. The
+ * tables are only rebuilt when the pixel type, subsampling or quality
+ * change; a new frame size only patches the cached header. Encoding
+ * stops once the output passes limit.
+ */
+static int jpeg_session_begin(struct jpeg_session *s, uint8_t *out, size_t limit,
+                              int w, int h, uint8_t pixel_type,
+                              uint8_t subsample, int qscale)
+{
+    JPEGE_IMAGE *jpeg = &s->jpeg;
+
+    jpeg->pOutput = out;
+    jpeg->iBufferSize = limit;
+    jpeg->pHighWater = &jpeg->pOutput[limit];
+
+    jpeg->pHuffStats = NULL;
+    if (s->huff_sample) {
+        memset(&s->huff_frame, 0, sizeof(s->huff_frame));
+        jpeg->pHuffStats = &s->huff_frame;
+    }
+
+    if (jpeg->iHeaderSize && s->pixel_type == pixel_type &&
+        s->subsample == subsample && s->qscale == qscale)
+        return JPEGEncodeRewind(jpeg, &s->jpe, w, h);
+
+    s->pixel_type = pixel_type;
+    s->subsample = subsample;
+    s->qscale = qscale;
+
+    return JPEGEncodeBeginScaled(jpeg, &s->jpe, w, h, pixel_type, subsample, qscale);
+}
+
+/* Counts of table t: Y DC, Y AC, CbCr DC, CbCr AC */
+static uint32_t *jpeg_huff_counts(JPEGE_HUFF_STATS *stats, int t, int *n)
+{
+    *n = t & 1 ? ARRAY_SIZE(stats->u32AC[0]) : ARRAY_SIZE(stats->u32DC[0]);
+    return t & 1 ? stats->u32AC[t >> 1] : stats->u32DC[t >> 1];
+}
+
+static void jpeg_huff_add(JPEGE_HUFF_STATS *sum, JPEGE_HUFF_STATS *stats)
+{
+    uint32_t *dst, *src;
+    int t, i, n;
+
+    for (t = 0; t < 4; t++) {
+        dst = jpeg_huff_counts(sum, t, &n);
+        src = jpeg_huff_counts(stats, t, &n);
+        for (i = 0; i < n; i++)
+            dst[i] += src[i];
+    }
+}
+
+static u64 jpeg_huff_total(JPEGE_HUFF_STATS *stats)
+{
+    uint32_t *counts;
+    u64 total = 0;
+    int t, i, n;
+
+    for (t = 0; t < 4; t++) {
+        counts = jpeg_huff_counts(stats, t, &n);
+        for (i = 0; i < n; i++)
+            total += counts[i];
+    }
+    return total;
+}
+
+/*
+ * Add the symbols of the frame just encoded to the histogram and switch
+ * to the tables built from it when they are enough of a gain. The
+ * header is rebuilt with them on the next frame. The older frames are
+ * scaled down to weigh no more than the new one first, so that a small
+ * update after a big one still moves the tables.
+ */
+static void jpeg_huff_update(struct jpeg_session *s)
+{
+    JPEGE_HUFF_STATS *stats = &s->huff_stats;
+    u64 bits = 0, best = 0, total;
+    int t, i, n, shift;
+    uint32_t *counts;
+
+    total = jpeg_huff_total(&s->huff_frame);
+    for (shift = 0; shift < 32 && (jpeg_huff_total(stats) >> shift) > total; shift++)
+        ;
+    for (t = 0; t < 4; t++) {
+        counts = jpeg_huff_counts(stats, t, &n);
+        for (i = 0; i < n; i++)
+            counts[i] = shift < 32 ? counts[i] >> shift : 0;
+    }
+    jpeg_huff_add(stats, &s->huff_frame);
+
+    for (t = 0; t < 4; t++) {
+        counts = jpeg_huff_counts(stats, t, &n);
+        JPEGMakeHuffSpec(&s->huff_work, counts, t & 1, s->huff_next[t]);
+        bits += JPEGHuffCost(JPEGGetHuffSpec(&s->jpeg, t), counts, t & 1);
+        best += JPEGHuffCost(s->huff_next[t], counts, t & 1);
+    }
+
+    if (best < bits && bits - best >= bits / JPEG_HUFF_GAIN) {
+        memcpy(s->huff_spec, s->huff_next, sizeof(s->huff_spec));
+        for (t = 0; t < 4; t++)
+            s->jpeg.pHuffSpec[t] = s->huff_spec[t];
+        s->jpeg.iHeaderSize = 0;
+    }
+}
+
+/* Back to the Annex K tables, and start counting over */
+static void jpeg_huff_reset(struct jpeg_session *s)
+{
+    int t;
+
+    for (t = 0; t < 4; t++) {
+        if (s->jpeg.pHuffSpec[t])
+            s->jpeg.iHeaderSize = 0;
+        s->jpeg.pHuffSpec[t] = NULL;
+    }
+    memset(&s->huff_stats, 0, sizeof(s->huff_stats));
+    s->huff_frames = 0;
+}
+
+static size_t jpeg_rc_predict(struct jpeg_session *s, int step, int mcus)
+{
+    return div_u64((u64)s->complexity * mcus * jpeg_rc_shape[step], 256 * 16);
+}
+
+/*
+ * Tables fitted to one scene can do much worse than Annex K on the next,
+ * where symbols that were rare get frequent. A frame twice its predicted
+ * size, or over the budget, goes back to Annex K and has the next frame
+ * sampled.
+ */
+static void jpeg_huff_check(struct jpeg_session *s, int step, int mcus,
+                            size_t len, bool blown)
+{
+    size_t predicted;
+
+    if (!s->jpeg.pHuffSpec[0] || !s->complexity)
+        return;
+
+    predicted = jpeg_rc_predict(s, step, mcus);
+    if (blown || len > predicted * 2)
+        jpeg_huff_reset(s);
+}
+
+/* Finest step whose predicted size leaves 1/8 of the budget spare */
+static int jpeg_rc_pick(struct jpeg_session *s, int mcus, size_t budget)
+{
+    int step;
+
+    if (!s->complexity)
+        return JPEG_RC_DEFAULT;
+
+    for (step = 0; step < JPEG_RC_STEPS - 1; step++)
+        if (jpeg_rc_predict(s, step, mcus) <= budget - budget / 8)
+            break;
+
+    return step;
+}
+
+/*
+ * Fold the size of a frame encoded at step into the complexity estimate.
+ * A blown budget means the scene changed, so it replaces the estimate
+ * instead of being averaged in.
+ */
+static void jpeg_rc_update(struct jpeg_session *s, int step, int mcus,
+                           size_t bytes, bool blown)
+{
+    uint32_t c;
+
+    c = div_u64((u64)bytes * 256 * 16, (u64)mcus * jpeg_rc_shape[step]);
+    if (!c)
+        c = 1;
+
+    if (blown || !s->complexity)
+        s->complexity = c;
+    else
+        s->complexity = (s->complexity * 3 + c) / 4;
+}
+
+/*
+ * How big the rows from first_row on would have been, from the bytes
+ * written and how far the encoder got.
+ */
+static size_t jpeg_rc_extrapolate(JPEGE_IMAGE *jpeg, JPEGENCODE *jpe,
+                                  int first_row, size_t bytes, int mcus)
+{
+    int done;
+
+    done = (jpe->y / jpe->cy - first_row) * jpeg->iMCUWidth + jpe->x / jpe->cx;
+    if (done <= 0)
+        done = 1;
+
+    return div_u64((u64)bytes * mcus, done);
+}
+
+static void jpeg_band_work(struct work_struct *work)
+{
+    struct jpeg_band *band = container_of(work, struct jpeg_band, work);
+
+    band->rc = JPEGAddRows(&band->jpeg, &band->jpe, band->pixels, band->pitch,
+                           band->row, band->rows);
+}
+
+/*
+ * Number of bands to cut the current frame into, making sure each has a
+ * scratch buffer of at least size bytes. Falls back to fewer bands when
+ * memory is short.
+ */
+static int jpeg_bands_prepare(struct jpeg_session *s, size_t size)
+{
+    struct jpeg_band *band;
+    int i, n;
+
+    if (!parallel_encode || !s->wq)
+        return 1;
+
+    n = min3((int)num_online_cpus(), JPEG_MAX_BANDS,
+             s->jpeg.iMCUHeight / JPEG_BAND_MIN_ROWS);
+
+    for (i = 0; i < n; i++) {
+        band = s->bands[i];
+        if (!band) {
+            band = kzalloc(sizeof(*band), GFP_KERNEL);
+            if (!band)
+                break;
+            INIT_WORK(&band->work, jpeg_band_work);
+            s->bands[i] = band;
+        }
+
+        if (band->size < size) {
+            kvfree(band->buf);
+            band->size = 0;
+            band->buf = kvmalloc(size, GFP_KERNEL);
+            if (!band->buf)
+                break;
+            band->size = size;
+        }
+    }
+
+    return max(i, 1);
+}
+
+/*
+ * Encode the frame set up by jpeg_session_begin() as n bands of MCU rows.
+ * The first band runs on this CPU, the others on the next online CPUs.
+ * Each band starts with fresh DC predictors and its own RSTn count, so
+ * the outputs are simply appended to the header in row order.
+ */
+static int jpeg_encode_bands(struct jpeg_session *s, int n, uint8_t *pixels,
+                             int pitch, size_t limit, size_t *len)
+{
+    JPEGE_IMAGE *jpeg = &s->jpeg;
+    struct jpeg_band *band;
+    int i, row, cpu, rc = JPEGE_SUCCESS;
+    size_t bytes, size;
+
+    cpu = raw_smp_processor_id();
+    for (i = 0, row = 0; i < n; i++) {
+        band = s->bands[i];
+
+        /* everything up to the file I/O state */
+        memcpy(&band->jpeg, jpeg, offsetof(JPEGE_IMAGE, pfnRead));
+        band->jpe = s->jpe;
+        band->jpeg.pOutput = band->buf;
+        band->jpeg.pHighWater = &band->buf[limit];
+        band->jpeg.pHuffStats = NULL;
+        if (jpeg->pHuffStats) {
+            memset(&band->huff, 0, sizeof(band->huff));
+            band->jpeg.pHuffStats = &band->huff;
+        }
+        band->pixels = pixels;
+        band->pitch = pitch;
+        band->row = row;
+        band->rows = jpeg->iMCUHeight * (i + 1) / n - row;
+        row += band->rows;
+
+        if (i == 0)
+            continue;
+
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+        queue_work_on(cpu, s->wq, &band->work);
+    }
+
+    jpeg_band_work(&s->bands[0]->work);
+    for (i = 1; i < n; i++)
+        flush_work(&s->bands[i]->work);
+
+    bytes = jpeg->iHeaderSize;
+    for (i = 0; i < n; i++) {
+        band = s->bands[i];
+        size = band->jpeg.pc.pOut - band->buf;
+
+        if (band->rc == JPEGE_NO_BUFFER) {
+            size = jpeg_rc_extrapolate(&band->jpeg, &band->jpe, band->row, size,
+                                       band->rows * jpeg->iMCUWidth);
+            rc = JPEGE_NO_BUFFER;
+        } else if (band->rc != JPEGE_SUCCESS) {
+            return band->rc;
+        }
+
+        if (rc == JPEGE_SUCCESS && bytes + size <= limit)
+            memcpy(&jpeg->pOutput[bytes], band->buf, size);
+        else
+            rc = JPEGE_NO_BUFFER;
+        bytes += size;
+
+        if (jpeg->pHuffStats)
+            jpeg_huff_add(jpeg->pHuffStats, &band->huff);
+    }
+
+    if (rc == JPEGE_SUCCESS) {
+        jpeg->iDataSize = bytes;
+        bytes = JPEGEncodeEnd(jpeg);
+    }
+    *len = bytes;
+
+    return rc;
+}
+
+/*
+ * Encode the frame set up by jpeg_session_begin(). On JPEGE_NO_BUFFER len
+ * is an estimate of the size the frame would have had.
+ */
+static int jpeg_session_encode(struct jpeg_session *s, uint8_t *pixels,
+                               int pitch, size_t limit, size_t *len)
+{
+    JPEGE_IMAGE *jpeg = &s->jpeg;
+    int rc, n, mcus;
+
+    n = jpeg_bands_prepare(s, limit + JPEG_ENCODE_SLACK);
+    if (n > 1)
+        return jpeg_encode_bands(s, n, pixels, pitch, limit, len);
+
+    mcus = jpeg->iMCUWidth * jpeg->iMCUHeight;
+    rc = JPEGAddFrame(jpeg, &s->jpe, pixels, pitch);
+    if (rc == JPEGE_SUCCESS)
+        *len = JPEGEncodeEnd(jpeg);
+    else if (rc == JPEGE_NO_BUFFER)
+        *len = jpeg_rc_extrapolate(jpeg, &s->jpe, 0,
+                                   jpeg->pc.pOut - jpeg->pOutput - jpeg->iHeaderSize,
+                                   mcus);
+    return rc;
+}
+
+int jpeg_encode_bmp(struct jpeg_session *session, uint8_t *bmp, size_t len,
+                    uint8_t *out, size_t budget, size_t *out_size)
 {
     int rc, y, w, h, bits, offset;
     int pitch, bytewidth, delta;
-    uint8_t *buffer, *bmp_tmp;
-    size_t buffer_size;
+    uint8_t *bmp_tmp;
     uint8_t *src, *dst;
-    JPEGE_IMAGE jpeg;
-    JPEGENCODE jpe;
+
+    *out_size = 0;
 
     /* Sanity check */
     if (bmp[0] != 'B' || bmp[1] != 'M' || bmp[14] < 0x28) {
         printk("Not a BMP file\n");
-        return NULL;
+        return -EINVAL;
     }
 
     w = *(int32_t *)&bmp[18];
@@ -24,7 +491,7 @@ uint8_t *jpeg_encode_bmp(uint8_t *bmp, size_t len, size_t *out_size)
     bits = *(int16_t *)&bmp[26] * *(int16_t *)&bmp[28];
     if (bits != 16) {
         printk("Not a 16-bit BMP file\n");
-        return NULL;
+        return -EINVAL;
     }
 
     offset = *(int32_t *)&bmp[10];
@@ -32,9 +499,9 @@ uint8_t *jpeg_encode_bmp(uint8_t *bmp, size_t len, size_t *out_size)
     pitch = (bytewidth + 3) & 0xfffc;
     // printk("%s, w : %d, h : %d, pitch : %d\n", __func__, w, h, pitch);
 
-    buffer_size = len;
-    buffer = (uint8_t *)kmalloc(buffer_size, GFP_KERNEL);
-    bmp_tmp = (uint8_t *)kmalloc(buffer_size, GFP_KERNEL);
+    bmp_tmp = (uint8_t *)kmalloc(len, GFP_KERNEL);
+    if (!bmp_tmp)
+        return -ENOMEM;
 
     dst = bmp_tmp;
     src = &bmp[offset];
@@ -52,56 +519,89 @@ uint8_t *jpeg_encode_bmp(uint8_t *bmp, size_t len, size_t *out_size)
         src += delta;
     }
 
-    memset(&jpeg, 0, sizeof(JPEGE_IMAGE));
-    jpeg.pOutput = buffer;
-    jpeg.iBufferSize = buffer_size;
-    jpeg.pHighWater = &jpeg.pOutput[jpeg.iBufferSize - 512];
-
-    rc = JPEGEncodeBegin(&jpeg, &jpe, w, h, JPEGE_PIXEL_RGB565, JPEGE_SUBSAMPLE_420, JPEGE_Q_HIGH);
+    session->huff_sample = false;
+    rc = jpeg_session_begin(session, out, budget, w, h, JPEGE_PIXEL_RGB565,
+                            JPEGE_SUBSAMPLE_420, JPEGE_QSCALE_HIGH);
     if (rc == JPEGE_SUCCESS)
-        JPEGAddFrame(&jpeg, &jpe, bmp_tmp, pitch);
-
-    JPEGEncodeEnd(&jpeg);
-    // printk("%s, jpeg size : %d\n", __func__, jpeg.iDataSize);
-    *out_size = jpeg.iDataSize;
+        rc = JPEGAddFrame(&session->jpeg, &session->jpe, bmp_tmp, pitch);
 
     kfree(bmp_tmp);
 
-    return buffer;
+    if (rc != JPEGE_SUCCESS)
+        return rc == JPEGE_NO_BUFFER ? -ENOSPC : -EINVAL;
+
+    *out_size = JPEGEncodeEnd(&session->jpeg);
+    // printk("%s, jpeg size : %zu\n", __func__, *out_size);
+
+    return 0;
 }
 
-uint8_t *jpeg_encode_rgb565(uint8_t *rgb565, size_t len, size_t *out_size)
+/*
+ * Encode a frame of at most budget bytes. The quantizer is picked from
+ * the recent compressed sizes; a frame that still comes out too large is
+ * encoded again at a coarser scale. Returns -ENOSPC when even the
+ * coarsest scale does not fit.
+ */
+static int jpeg_encode_frame(struct jpeg_session *session, uint8_t *pixels,
+                             uint8_t pixel_type, int width, int height, int pitch,
+                             uint8_t *out, size_t budget, size_t *out_size)
 {
-    int rc, w, h, bits;
-    int pitch, bytewidth;
-    uint8_t *buffer;
-    size_t buffer_size;
-    JPEGE_IMAGE jpeg;
-    JPEGENCODE jpe;
+    int rc, step, next, mcus;
+    size_t len = 0;
 
-    w = 480;
-    h = 320;
-    bits = 16;
+    // printk("%s, w : %d, h : %d, pitch : %d\n", __func__, width, height, pitch);
 
-    bytewidth = (w * bits) >> 3;
-    pitch = (bytewidth + 3) & 0xfffc;
-    // printk("%s, w : %d, h : %d, pitch : %d\n", __func__, w, h, pitch);
+    *out_size = 0;
+    mcus = DIV_ROUND_UP(width, 16) * DIV_ROUND_UP(height, 16);
 
-    buffer_size = len;
-    buffer = (uint8_t *)kmalloc(buffer_size, GFP_KERNEL);
+    if (!optimize_huffman && session->huff_frames)
+        jpeg_huff_reset(session);
+    session->huff_sample = optimize_huffman &&
+                           session->huff_frames++ % JPEG_HUFF_SAMPLE == 0;
 
-    memset(&jpeg, 0, sizeof(JPEGE_IMAGE));
-    jpeg.pOutput = buffer;
-    jpeg.iBufferSize = buffer_size;
-    jpeg.pHighWater = &jpeg.pOutput[jpeg.iBufferSize - 512];
+    step = jpeg_rc_pick(session, mcus, budget);
+    for (;;) {
+        rc = jpeg_session_begin(session, out, budget, width, height,
+                                pixel_type, JPEGE_SUBSAMPLE_420,
+                                jpeg_rc_scale[step]);
+        if (rc == JPEGE_SUCCESS)
+            rc = jpeg_session_encode(session, pixels, pitch, budget, &len);
 
-    rc = JPEGEncodeBegin(&jpeg, &jpe, w, h, JPEGE_PIXEL_RGB565, JPEGE_SUBSAMPLE_420, JPEGE_Q_LOW);
-    if (rc == JPEGE_SUCCESS)
-        JPEGAddFrame(&jpeg, &jpe, rgb565, pitch);
+        if (rc == JPEGE_SUCCESS && len <= budget) {
+            jpeg_huff_check(session, step, mcus, len, false);
+            jpeg_rc_update(session, step, mcus, len, false);
+            if (session->huff_sample)
+                jpeg_huff_update(session);
+            break;
+        }
+
+        if (rc != JPEGE_SUCCESS && rc != JPEGE_NO_BUFFER)
+            return -EINVAL;
 
-    JPEGEncodeEnd(&jpeg);
-    // printk("%s, jpeg size : %d\n", __func__, jpeg.iDataSize);
-    *out_size = jpeg.iDataSize;
+        jpeg_huff_check(session, step, mcus, len, true);
+        jpeg_rc_update(session, step, mcus, len, true);
+        next = jpeg_rc_pick(session, mcus, budget);
+        step = max(next, step + 1);
+        if (step >= JPEG_RC_STEPS)
+            return -ENOSPC;
+    }
+    *out_size = len;
+
+    return 0;
+}
 
-    return buffer;
+int jpeg_encode_rgb565(struct jpeg_session *session, uint8_t *rgb565,
+                       int width, int height, int pitch,
+                       uint8_t *out, size_t budget, size_t *out_size)
+{
+    return jpeg_encode_frame(session, rgb565, JPEGE_PIXEL_RGB565, width, height,
+                             pitch, out, budget, out_size);
+}
+
+int jpeg_encode_xrgb8888(struct jpeg_session *session, uint8_t *xrgb8888,
+                         int width, int height, int pitch,
+                         uint8_t *out, size_t budget, size_t *out_size)
+{
+    return jpeg_encode_frame(session, xrgb8888, JPEGE_PIXEL_XRGB8888, width,
+                             height, pitch, out, budget, out_size);
 }
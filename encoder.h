@@ -3,7 +3,28 @@
 
 #include <linux/kernel.h>
 
-uint8_t *jpeg_encode_bmp(uint8_t *bmp, size_t len, size_t *out_size);
-uint8_t *jpeg_encode_rgb565(uint8_t *rgb565, size_t len, size_t *out_size);
+/* Long-lived encoder state, one per device. Callers serialize access. */
+struct jpeg_session;
+
+struct jpeg_session *jpeg_session_alloc(void);
+void jpeg_session_free(struct jpeg_session *session);
+
+/* Bytes the encoder may write past the budget it is given */
+#define JPEG_ENCODE_SLACK   4096
+
+/*
+ * Encode into out, which must hold budget + JPEG_ENCODE_SLACK bytes.
+ * Return 0 and the JPEG size in out_size, or a negative errno; -ENOSPC
+ * when the frame does not fit the budget.
+ */
+int jpeg_encode_bmp(struct jpeg_session *session, uint8_t *bmp, size_t len,
+                    uint8_t *out, size_t budget, size_t *out_size);
+int jpeg_encode_rgb565(struct jpeg_session *session, uint8_t *rgb565,
+                       int width, int height, int pitch,
+                       uint8_t *out, size_t budget, size_t *out_size);
+/* DRM_FORMAT_XRGB8888, read as is without going through RGB565 */
+int jpeg_encode_xrgb8888(struct jpeg_session *session, uint8_t *xrgb8888,
+                         int width, int height, int pitch,
+                         uint8_t *out, size_t budget, size_t *out_size);
 
 #endif
\ No newline at end of file
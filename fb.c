@@ -14,50 +14,71 @@
 #include <linux/kernel.h>
 #include <linux/version.h>
 #include <linux/fb.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
 
 #include "udd.h"
+#include "udd_trace.h"
 #include "encoder.h"
 
-struct dirty_area {
-    u32 x1;
-    u32 y1;
-    u32 x2;
-    u32 y2;
-};
+/* More dirty bands than this in one update are sent as a single band */
+#define UDD_FB_MAX_BANDS    4
+
+/*
+ * Lines y1 to y2 (exclusive) were drawn without going through the mmap
+ * page tracking; mark their MCU rows and make sure an update follows.
+ */
+static void udd_fb_damage(struct fb_info *info, u32 y1, u32 y2)
+{
+    struct udd *udd = info->par;
+    unsigned long flags;
+
+    y2 = min(y2, info->var.yres);
+    if (y1 >= y2)
+        return;
+
+    spin_lock_irqsave(&udd->fb_rows_lock, flags);
+    bitmap_set(udd->fb_rows, y1 / UDD_MCU_SIZE,
+               DIV_ROUND_UP(y2, UDD_MCU_SIZE) - y1 / UDD_MCU_SIZE);
+    spin_unlock_irqrestore(&udd->fb_rows_lock, flags);
+
+    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+}
 
 static ssize_t udd_fb_read(struct fb_info *info, char __user *buf,
 			   size_t count, loff_t *ppos)
 {
-    pr_info("%s\n", __func__);
     return fb_sys_read(info, buf, count, ppos);
 }
 
 static ssize_t udd_fb_write(struct fb_info *info, const char __user *buf,
 			    size_t count, loff_t *ppos)
 {
+    loff_t pos = *ppos;
     ssize_t ret = 0;
-    pr_info("%s: count=%zd, ppos=%llu\n", __func__,  count, *ppos);
     ret = fb_sys_write(info, buf, count, ppos);
-    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+    if (ret > 0)
+        udd_fb_damage(info, pos / info->fix.line_length,
+                      DIV_ROUND_UP(pos + ret, info->fix.line_length));
     return ret;
 }
 
 static void udd_fb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
 {
-    pr_info("%s\n", __func__);
     sys_fillrect(info, rect);
+    udd_fb_damage(info, rect->dy, rect->dy + rect->height);
 }
 
 static void udd_fb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
 {
-    pr_info("%s\n", __func__);
     sys_copyarea(info, area);
+    udd_fb_damage(info, area->dy, area->dy + area->height);
 }
 
 static void udd_fb_imageblit(struct fb_info *info, const struct fb_image *image)
 {
-    pr_info("%s\n", __func__);
-    //sys_imageblit(info, image);
+    sys_imageblit(info, image);
+    udd_fb_damage(info, image->dy, image->dy + image->height);
 }
 
 /* from pxafb.c */
@@ -117,50 +138,119 @@ static int udd_fb_blank(int blank, struct fb_info *info)
     return ret;
 }
 
+/*
+ * Encode lines y1 to y2 (exclusive) of the screen and send them. A band
+ * that does not go out is marked dirty again for the next update.
+ */
+static void udd_fb_send_band(struct fb_info *info, u32 y1, u32 y2)
+{
+    struct udd *udd = info->par;
+    size_t jpeg_length = 0;
+    struct udd_tx_slot *slot;
+    ktime_t start;
+    ssize_t ret;
+
+    slot = udd_tx_get(udd);
+    if (IS_ERR(slot)) {
+        if (PTR_ERR(slot) != -ESHUTDOWN)
+            udd_fb_damage(info, y1, y2);
+        return;
+    }
+
+    trace_udd_damage(udd->frame, 0, y1, info->var.xres, y2);
+    trace_udd_encode_begin(udd->frame, info->var.xres, y2 - y1,
+                           udd_tx_budget(udd));
+    start = ktime_get();
+    ret = jpeg_encode_rgb565(udd->jpeg,
+                             info->screen_buffer + y1 * info->fix.line_length,
+                             info->var.xres, y2 - y1, info->fix.line_length,
+                             slot->buf, udd_tx_budget(udd), &jpeg_length);
+    udd_stat_hist(udd, UDD_HIST_ENCODE, udd_stat_us(start));
+    trace_udd_encode_end(udd->frame, jpeg_length, ret);
+    if (ret) {
+        pr_warn_ratelimited("%s, frame does not fit the link, dropped\n", __func__);
+        udd_stat_inc(udd, oversize);
+        udd_stat_inc(udd, dropped);
+        udd_tx_put(udd, slot);
+        udd_fb_damage(info, y1, y2);
+        return;
+    }
+
+    if (y1 == 0 && y2 == info->var.yres)
+        ret = udd_flush(udd, slot, jpeg_length);
+    else
+        ret = udd_flush_region(udd, slot, 0, y1, info->var.xres, y2 - y1,
+                               jpeg_length);
+    if (ret < 0)
+        udd_fb_damage(info, y1, y2);
+}
+
+/*
+ * Send the MCU rows touched since the last update, from the pages written
+ * through mmap and the lines drawn by write() and the drawing ops. Each
+ * run of dirty rows goes out as a full width region.
+ */
 static void udd_fb_deferred_io(struct fb_info *info, struct list_head *pagereflist)
 {
-    ssize_t jpeg_length = 0;
-    // struct fb_deferred_io_pageref *pageref;
-    // struct dirty_area area = {0};
-    // uint y_cur, y_end;
+    unsigned int rows = DIV_ROUND_UP(info->var.yres, UDD_MCU_SIZE);
+    u32 line_length = info->fix.line_length;
+    struct fb_deferred_io_pageref *pageref;
+    unsigned int start, end, first, last;
+    unsigned int bands = 0;
     struct udd *udd;
-    u8 *jpeg_data;
+    u32 y1, y2;
 
     udd = info->par;
 
-// TODO: support partial update
-#ifdef SUPPORT_PARTIAL_UPDATE
-    area.y1 = info->var.yres - 1;
-    list_for_each_entry(pageref, pagereflist, list) {
-        y_cur = pageref->offset / info->fix.line_length;
-        y_end = (pageref->offset + PAGE_SIZE) / info->fix.line_length;
-
-        if (y_end > info->var.yres - 1)
-            y_end = info->var.yres - 1;
-        if (y_cur < area.y1)
-            area.y1 = y_cur;
-        if (y_end > area.y2)
-            area.y2 = y_end;
-    }
+    spin_lock_irq(&udd->fb_rows_lock);
+    bitmap_copy(udd->fb_rows_sent, udd->fb_rows, rows);
+    bitmap_zero(udd->fb_rows, rows);
+    spin_unlock_irq(&udd->fb_rows_lock);
 
-    if (y_end > 1)
-        area.x2 = info->var.xres - 1;
+    /* a band went missing on the way, the device may show anything */
+    if (udd_tx_lost(udd))
+        bitmap_set(udd->fb_rows_sent, 0, rows);
 
-    pr_info("%s, dirty area: (%d, %d, %d, %d)\n", __func__, area.x1, area.y1, area.x2, area.y2);
-#endif
+    list_for_each_entry(pageref, pagereflist, list) {
+        y1 = pageref->offset / line_length;
+        y2 = min_t(u32, DIV_ROUND_UP(pageref->offset + PAGE_SIZE, line_length),
+                   info->var.yres);
+        if (y1 < y2)
+            bitmap_set(udd->fb_rows_sent, y1 / UDD_MCU_SIZE,
+                       DIV_ROUND_UP(y2, UDD_MCU_SIZE) - y1 / UDD_MCU_SIZE);
+    }
 
+    first = find_first_bit(udd->fb_rows_sent, rows);
+    if (first >= rows)
+        return;
+    trace_udd_update(++udd->frame);
+    last = find_last_bit(udd->fb_rows_sent, rows);
 
-    jpeg_data = jpeg_encode_rgb565(info->screen_buffer,
-                                info->fix.line_length * info->var.yres, &jpeg_length);
+    /* the device only takes whole frames */
+    if (!(udd->caps.features & UDD_FEAT_REGION)) {
+        udd_fb_send_band(info, 0, info->var.yres);
+        return;
+    }
 
-    if (jpeg_length > USB_TRANS_MAX_SIZE)
-        // goto skip_frame;
-        jpeg_length = USB_TRANS_MAX_SIZE - 1;
+    for (start = first; start < rows;
+         start = find_next_bit(udd->fb_rows_sent, rows, end)) {
+        end = find_next_zero_bit(udd->fb_rows_sent, rows, start);
+        bands++;
+    }
 
-    udd_flush(udd->udev, jpeg_data, jpeg_length);
+    /* scattered writes, one band over all of them is cheaper */
+    if (bands > UDD_FB_MAX_BANDS) {
+        udd_fb_send_band(info, first * UDD_MCU_SIZE,
+                         min_t(u32, (last + 1) * UDD_MCU_SIZE, info->var.yres));
+        return;
+    }
 
-// skip_frame:
-    kfree(jpeg_data);
+    for (start = first; start < rows;
+         start = find_next_bit(udd->fb_rows_sent, rows, end)) {
+        end = find_next_zero_bit(udd->fb_rows_sent, rows, start);
+        udd_fb_send_band(info, start * UDD_MCU_SIZE,
+                         min_t(u32, end * UDD_MCU_SIZE, info->var.yres));
+    }
 }
 
 struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
@@ -169,6 +259,7 @@ struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
     struct fb_deferred_io *fbdefio;
     struct fb_ops *fbops;
     struct fb_info *info;
+    struct udd *udd;
     int width, height, bpp, rotate;
     u8 *vmem = NULL;
     int vmem_size;
@@ -182,7 +273,8 @@ struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
 
     vmem_size = (width * height * bpp) / BITS_PER_BYTE;
     pr_info("vmem_size: %d\n", vmem_size);
-    vmem = kzalloc(vmem_size, GFP_KERNEL);
+    /* deferred I/O finds the pages of vmalloc memory by itself */
+    vmem = vzalloc(vmem_size);
     if (!vmem) {
         pr_err("failed to allocate vmem\n");
         return NULL;
@@ -206,6 +298,15 @@ struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
         goto err_free_fbdefio;
     }
 
+    udd = info->par;
+    spin_lock_init(&udd->fb_rows_lock);
+    udd->fb_rows = bitmap_zalloc(DIV_ROUND_UP(height, UDD_MCU_SIZE), GFP_KERNEL);
+    udd->fb_rows_sent = bitmap_zalloc(DIV_ROUND_UP(height, UDD_MCU_SIZE), GFP_KERNEL);
+    if (!udd->fb_rows || !udd->fb_rows_sent) {
+        pr_err("failed to allocate dirty rows\n");
+        goto err_release_info;
+    }
+
     // info->dev = dev;
     info->screen_buffer = vmem;
     info->fbops = fbops;
@@ -240,6 +341,8 @@ struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
     info->var.yres           = height;
     info->var.xres_virtual   = info->var.xres;
     info->var.yres_virtual   = info->var.yres;
+    info->var.width          = display->width_mm;
+    info->var.height         = display->height_mm;
     info->var.bits_per_pixel = bpp;
     info->var.nonstd         = 1;
     info->var.grayscale      = 0;
@@ -262,19 +365,27 @@ struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
 
     return info;
 
+err_release_info:
+    bitmap_free(udd->fb_rows);
+    bitmap_free(udd->fb_rows_sent);
+    framebuffer_release(info);
 err_free_fbdefio:
     kfree(fbdefio);
 err_free_fbops:
     kfree(fbops);
 err_free_vmem:
-    kfree(vmem);
+    vfree(vmem);
     return NULL;
 }
 
 void udd_framebuffer_release(struct fb_info *info)
 {
+    struct udd *udd = info->par;
+
     fb_deferred_io_cleanup(info);
-    kfree(info->screen_buffer);
+    bitmap_free(udd->fb_rows);
+    bitmap_free(udd->fb_rows_sent);
+    vfree(info->screen_buffer);
     framebuffer_release(info);
 }
 
@@ -1,4 +1,7 @@
 #include "jpegenc.h"
+#ifdef JPEGE_SIMD
+#include <linux/fpu.h>
+#endif
 
 // Returns the magnitude and fixes negative values for JPEG encoding
 // Upper 16 bits is the new delta value, lower 16 is the magnitude
@@ -692,90 +695,212 @@ void JPEGFixQuantE(JPEGE_IMAGE *pJPEG)
     } // for iTable
 } /* JPEGFixQuantE() */
 
+//
+// The table in use for iTable (0 = Y DC, 1 = Y AC, 2 = CbCr DC, 3 = CbCr AC)
+//
+const uint8_t *JPEGGetHuffSpec(JPEGE_IMAGE *pJPEG, int iTable)
+{
+    static const uint8_t * const pAnnexK[4] = {huffl_dc, huffl_ac, huffcr_dc, huffcr_ac};
+
+    if (pJPEG->pHuffSpec[iTable])
+        return pJPEG->pHuffSpec[iTable];
+    return pAnnexK[iTable];
+} /* JPEGGetHuffSpec() */
+
 void JPEGMakeHuffE(JPEGE_IMAGE *pJPEG)
 {
-#ifdef USE_RAM_FOR_TABLES
-    int code, iLen, iTable;
+    int code, iLen, iTable, iClass;
     unsigned short *pTable;
     int iBitNum; // current code bit length
     int n_bits; // number of bits to do
     int cc; // code
-    unsigned char *p, *pBits;
+    const unsigned char *p, *pBits;
     int iTableCount;
 
+    if (!pJPEG->pHuffSpec[0] && !pJPEG->pHuffSpec[1] && !pJPEG->pHuffSpec[2] && !pJPEG->pHuffSpec[3])
+    { // the Annex K tables are prebuilt in FLASH
+        pJPEG->huffdc[0] = (int *)&hufftable[0];
+        pJPEG->huffdc[1] = (int *)&hufftable[2048];
+        return;
+    }
+
     if (pJPEG->ucNumComponents == 1)
         iTableCount = 1;
     else
         iTableCount = 2;
 
-    // first do DC components (up to 12-bit codes)
+    // DC codes and lengths go to 0 and 256, AC codes and lengths to 512 and 768
     for (iTable = 0; iTable < iTableCount; iTable++)
     {
-        pJPEG->huffdc[iTable] = (int *)&pJPEG->ucHuffACDCBuf[iTable*0x800]; // each table gets 2K
-        pTable = (unsigned short *)pJPEG->huffdc[iTable];
-        if (iTable == 0)
-            pBits = (unsigned char *)huffl_dc;
-        else
-            pBits = (unsigned char *)huffcr_dc;
-        p = (unsigned char *)pBits;
-        p += 16; // point to bit data
-        iBitNum = 1;
-        cc = 0; // start with a code of 0
-        for (n_bits = 0; n_bits < 16; n_bits++)
+        pJPEG->huffdc[iTable] = (int *)pJPEG->usHuffTable[iTable]; // each table gets 2K
+        for (iClass = 0; iClass < 2; iClass++)
         {
-            iLen = *pBits++; // get number of codes for this bit length
-            while (iLen)
+            pTable = &pJPEG->usHuffTable[iTable][iClass * 512];
+            pBits = JPEGGetHuffSpec(pJPEG, iTable * 2 + iClass);
+            p = pBits + 16; // point to symbol data
+            iBitNum = 1;
+            cc = 0; // start with a code of 0
+            for (n_bits = 0; n_bits < 16; n_bits++)
             {
-                code = *p++;  // get actual huffman code
-                pTable[code] = (unsigned short)cc;
-                pTable[code+256] = (unsigned short)iBitNum; // store the length here
-                cc++;
-                iLen--;
+                iLen = *pBits++; // get number of codes for this bit length
+                while (iLen)
+                {
+                    code = *p++;  // get the symbol
+                    pTable[code] = (unsigned short)cc;
+                    pTable[code+256] = (unsigned short)iBitNum; // store the length here
+                    cc++;
+                    iLen--;
+                }
+                iBitNum++;
+                cc <<= 1;
             }
-            iBitNum++;
-            cc <<= 1;
         }
     }
-    // now do AC components (up to 16-bit codes)
-    for (iTable = 0; iTable < iTableCount; iTable++)
+} /* JPEGMakeHuffE() */
+
+//
+// Symbols that can occur in 8-bit baseline data: DC differences of 0 to
+// 11 bits, and AC runs of 0-15 zeros before 1 to 10 bits, EOB and ZRL
+//
+static int JPEGHuffValid(int iSymbol, int bAC)
+{
+    if (!bAC)
+        return iSymbol <= 11;
+    return iSymbol == 0x00 || iSymbol == 0xf0 || ((iSymbol & 0xf) >= 1 && (iSymbol & 0xf) <= 10);
+} /* JPEGHuffValid() */
+
+//
+// Build the optimal table for the counted symbols, limited to 16-bit
+// codes and without an all-ones code (ITU T.81 Annex K.2). The tree is
+// built with two queues, the symbols sorted by frequency and the merged
+// trees in the order they are made, instead of searching for the two
+// least frequent each time. Every valid symbol gets a code, even if it
+// was not counted, so the table can be used for images other than the
+// one the counts came from.
+//
+void JPEGMakeHuffSpec(JPEGE_HUFF_WORK *pWork, const uint32_t *pu32Count, int bAC, uint8_t *pSpec)
+{
+    uint32_t *pu32Freq = pWork->u32Freq;
+    int16_t *psParent = pWork->sParent;
+    uint8_t *pucDepth = pWork->ucDepth;
+    uint16_t *pusSymbol = pWork->usSymbol;
+    uint8_t *pucSize = pWork->ucSize;
+    uint8_t ucBits[33];
+    int i, j, k, n, iLeaf, iTree, iTrees, iPick, iShift, iSymbols = bAC ? 256 : 16;
+    uint64_t u64Total = 0;
+    uint32_t u32Freq;
+
+    // Below Fibonacci(34) in total no code gets longer than 32 bits
+    for (i = 0; i < iSymbols; i++)
+        u64Total += pu32Count[i];
+    for (iShift = 0; (u64Total >> iShift) > (1 << 22); iShift++)
+        ;
+
+    // Sort the symbols by frequency. The reserved all-ones code point
+    // (256) goes first, so it ends up with one of the longest codes.
+    n = 0;
+    for (k = 0; k < 257; k++)
     {
-        pTable = (unsigned short *)pJPEG->huffdc[iTable];
-        if (iTable == 0)
-            pBits = (unsigned char *)huffl_ac;
+        i = (k + 256) % 257; // 256, 0, 1, ... 255
+        if (i == 256)
+            u32Freq = 1;
+        else if (i < iSymbols && JPEGHuffValid(i, bAC))
+            u32Freq = (pu32Count[i] >> iShift) + 1;
         else
-            pBits = (unsigned char *)huffcr_ac;
-        p = (unsigned char *)pBits;
-        p += 16; // point to bit data
-        iBitNum = 1;
-        cc = 0; // start with a code of 0
-        for (n_bits = 0; n_bits < 16; n_bits++)
+            continue;
+        for (j = n; j > 0 && pu32Freq[j - 1] > u32Freq; j--)
         {
-            iLen = *pBits++; // get number of codes for this bit length
-            while (iLen)
-            {
-                code = *p++;  // get actual huffman code
-                pTable[512+code] = (unsigned short)cc;
-                pTable[768+code] = (unsigned short)iBitNum;
-                cc++;
-                iLen--;
-            }
-            iBitNum++;
-            cc <<= 1;
+            pu32Freq[j] = pu32Freq[j - 1];
+            pusSymbol[j] = pusSymbol[j - 1];
         }
+        pu32Freq[j] = u32Freq;
+        pusSymbol[j] = (uint16_t)i;
+        n++;
     }
-    // write it to a file
-//    {
-//        FILE *ohandle = fopen("/Users/laurencebank/Downloads/hufftable.bin", "w+b");
-//        if (ohandle) {
-//            fwrite(pJPEG->ucHuffACDCBuf, 1, 4096, ohandle);
-//            fclose(ohandle);
-//        }
-//    }
-#else // read it from FLASH
-    pJPEG->huffdc[0] = (int *)&hufftable[0];
-    pJPEG->huffdc[1] = (int *)&hufftable[2048];
-#endif // USE_RAM_FOR_TABLES
-} /* JPEGMakeHuffE() */
+
+    // Merge the two least frequent of the next symbol and the next tree
+    // until one tree is left; the trees are made in frequency order
+    iLeaf = 0;
+    iTree = iTrees = n;
+    while ((n - iLeaf) + (iTrees - iTree) > 1)
+    {
+        pu32Freq[iTrees] = 0;
+        for (k = 0; k < 2; k++)
+        {
+            if (iLeaf < n && (iTree == iTrees || pu32Freq[iLeaf] <= pu32Freq[iTree]))
+                iPick = iLeaf++;
+            else
+                iPick = iTree++;
+            psParent[iPick] = (int16_t)iTrees;
+            pu32Freq[iTrees] += pu32Freq[iPick];
+        }
+        iTrees++;
+    }
+    // code lengths are the depths in the tree, the root is made last
+    pucDepth[iTrees - 1] = 0;
+    for (i = iTrees - 2; i >= 0; i--)
+        pucDepth[i] = pucDepth[psParent[i]] + 1;
+
+    memset(ucBits, 0, sizeof(ucBits));
+    memset(pucSize, 0, 257);
+    for (i = 0; i < n; i++)
+    {
+        pucSize[pusSymbol[i]] = pucDepth[i];
+        ucBits[pucDepth[i]]++;
+    }
+    // shorten the codes over 16 bits by pairing them up with shorter ones
+    for (i = 32; i > 16; i--)
+    {
+        while (ucBits[i] > 0)
+        {
+            j = i - 2;
+            while (ucBits[j] == 0)
+                j--;
+            ucBits[i] -= 2;
+            ucBits[i - 1]++;
+            ucBits[j + 1] += 2;
+            ucBits[j]--;
+        }
+    }
+    // give back the reserved code, it is one of the longest
+    while (ucBits[i] == 0)
+        i--;
+    ucBits[i]--;
+
+    // the symbols by code length, then by value
+    memcpy(pSpec, &ucBits[1], 16);
+    pSpec += 16;
+    for (i = 1; i <= 32; i++)
+    {
+        for (j = 0; j < 256; j++)
+        {
+            if (pucSize[j] == i)
+                *pSpec++ = (uint8_t)j;
+        }
+    }
+} /* JPEGMakeHuffSpec() */
+
+//
+// Bits the counted symbols take with the table in pSpec, the magnitude
+// bits that follow each code included
+//
+uint64_t JPEGHuffCost(const uint8_t *pSpec, const uint32_t *pu32Count, int bAC)
+{
+    const uint8_t *pSymbol = pSpec + 16;
+    uint64_t u64Bits = 0;
+    int iLen, i;
+
+    for (iLen = 1; iLen <= 16; iLen++)
+    {
+        for (i = 0; i < pSpec[iLen - 1]; i++, pSymbol++)
+        {
+            if (!bAC && *pSymbol >= 16)
+                continue;
+            u64Bits += (uint64_t)pu32Count[*pSymbol] * (iLen + (*pSymbol & 0xf));
+        }
+    }
+    return u64Bits;
+} /* JPEGHuffCost() */
 //
 // Finish the file
 //
@@ -802,17 +927,99 @@ int JPEGEncodeEnd(JPEGE_IMAGE *pJPEG)
     return 0; // something went wrong
 } /* JPEGEncodeEnd() */
 //
+// Start another frame with the same pixel type, subsampling and quality
+// as the last JPEGEncodeBegin(). The header, quantization and Huffman
+// tables are reused; only the image size fields are patched and the
+// predictors and bit writer are reset.
+//
+int JPEGEncodeRewind(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight)
+{
+    uint8_t *pBuf;
+    int i;
+
+    if (pEncode == NULL || pJPEG == NULL || pJPEG->iHeaderSize == 0) {
+        return JPEGE_INVALID_PARAMETER;
+    }
+    if (iWidth != pJPEG->iWidth || iHeight != pJPEG->iHeight) {
+        pJPEG->iWidth = iWidth;
+        pJPEG->iHeight = iHeight;
+        pJPEG->iMCUWidth = (iWidth + pEncode->cx - 1) / pEncode->cx;
+        pJPEG->iMCUHeight = (iHeight + pEncode->cy - 1) / pEncode->cy;
+        if (pJPEG->ucPixelType != JPEGE_PIXEL_GRAYSCALE && pJPEG->ucSubSample == JPEGE_SUBSAMPLE_420)
+            i = (iWidth + 15) / 16; // same restart interval as JPEGEncodeBegin()
+        else
+            i = (iWidth + 7) / 8;
+        WRITEMOTO16(pJPEG->ucHeader, pJPEG->iDRIOffset, i);
+        WRITEMOTO16(pJPEG->ucHeader, pJPEG->iSOFOffset, iHeight);
+        WRITEMOTO16(pJPEG->ucHeader, pJPEG->iSOFOffset + 2, iWidth);
+    }
+    pJPEG->iDCPred0 = pJPEG->iDCPred1 = pJPEG->iDCPred2 = 0;
+    pJPEG->iRestart = 0;
+    pJPEG->iDataSize = 0;
+    pEncode->x = pEncode->y = 0;
+    pJPEG->pc.iLen = pJPEG->pc.ulAcc = 0;
+    if (pJPEG->pOutput) {
+        pBuf = pJPEG->pOutput;
+    } else {
+        pBuf = pJPEG->ucFileBuf;
+    }
+    memcpy(pBuf, pJPEG->ucHeader, pJPEG->iHeaderSize);
+    pJPEG->pc.pOut = &pBuf[pJPEG->iHeaderSize];
+    pJPEG->iError = JPEGE_SUCCESS;
+    return JPEGE_SUCCESS;
+} /* JPEGEncodeRewind() */
+//
+// Scale one Annex K table entry, iQScale is in percent
+// (25, 50, 100 and 200 give the BEST, HIGH, MED and LOW tables)
+//
+static uint8_t JPEGScaleQuant(int iQ, int iQScale)
+{
+    iQ = (iQ * iQScale) / 100;
+    if (iQ < 1)
+        iQ = 1;
+    else if (iQ > 255)
+        iQ = 255;
+    return (uint8_t)iQ;
+} /* JPEGScaleQuant() */
+//
 // Initialize the encoder
 //
 int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight, uint8_t ucPixelType, uint8_t ucSubSample, uint8_t ucQFactor)
+{
+    int iQScale;
+
+    switch (ucQFactor) // adjust table depending on quality factor
+    {
+        default:
+        case JPEGE_Q_BEST: // best quality, divide by 4
+            iQScale = JPEGE_QSCALE_BEST;
+            break;
+        case JPEGE_Q_HIGH: // high quality, divide by 2
+            iQScale = JPEGE_QSCALE_HIGH;
+            break;
+        case JPEGE_Q_MED: // medium quality factor, use values unchanged
+            iQScale = JPEGE_QSCALE_MED;
+            break;
+        case JPEGE_Q_LOW: // low quality, use values * 2
+            iQScale = JPEGE_QSCALE_LOW;
+            break;
+    }
+    return JPEGEncodeBeginScaled(pJPEG, pEncode, iWidth, iHeight, ucPixelType, ucSubSample, iQScale);
+} /* JPEGEncodeBegin() */
+//
+// Initialize the encoder with an arbitrary quantizer scale
+//
+int JPEGEncodeBeginScaled(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight, uint8_t ucPixelType, uint8_t ucSubSample, int iQScale)
 {
     uint8_t *pBuf;
     int i;
     int iOffset = 0;
-    if (pEncode == NULL || pJPEG == NULL) {
+    if (pEncode == NULL || pJPEG == NULL || iQScale <= 0 || iQScale > JPEGE_QSCALE_MAX) {
         return JPEGE_INVALID_PARAMETER;
     }
     pJPEG->iDCPred0 = pJPEG->iDCPred1 = pJPEG->iDCPred2 = 0; // DC predictor values reset to 0
+    pJPEG->iRestart = 0;
+    pJPEG->iDataSize = 0;
     pJPEG->iWidth = iWidth;
     pJPEG->iHeight = iHeight;
     pJPEG->ucPixelType = ucPixelType;
@@ -861,25 +1068,7 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
     pBuf[iOffset++] = 0; // table type and number 0,8 bit
     for (i=0; i<64; i++)
     {
-        switch (ucQFactor) // adjust table depending on quality factor
-        {
-            default:
-            case JPEGE_Q_BEST: // best quality, divide by 4
-                pBuf[iOffset++] = quant_lum[i] >> 2;
-                break;
-            case JPEGE_Q_HIGH: // high quality, divide by 2
-                pBuf[iOffset++] = quant_lum[i] >> 1;
-                break;
-            case JPEGE_Q_MED: // medium quality factor, use values unchanged
-                pBuf[iOffset++] = quant_lum[i];
-                break;
-            case JPEGE_Q_LOW: // low quality, use values * 2
-                pBuf[iOffset++] = quant_lum[i] << 1;
-                break;
-//            case 4: // ridiculously high quality
-//                pBuf[iOffset++] = quant95_lum[i];
-//                break;
-        }
+        pBuf[iOffset++] = JPEGScaleQuant(quant_lum[i], iQScale);
     }
     if (pJPEG->ucPixelType != JPEGE_PIXEL_GRAYSCALE) // add color quant tables
     {
@@ -890,24 +1079,7 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
         pBuf[iOffset++] = 1;  // table 1, 8 bit
         for (i=0; i<64; i++)
         {
-            switch (ucQFactor) // adjust table depending on quality factor
-            {
-                case JPEGE_Q_BEST: // best quality, divide by 4
-                    pBuf[iOffset++] = quant_color[i] >> 2;
-                    break;
-                case JPEGE_Q_HIGH: // high quality, divide by 2
-                    pBuf[iOffset++] = quant_color[i] >> 1;
-                    break;
-                case JPEGE_Q_MED: // medium quality factor, use values unchanged
-                    pBuf[iOffset++] = quant_color[i];
-                    break;
-                case JPEGE_Q_LOW: // low quality, use values * 2
-                    pBuf[iOffset++] = quant_color[i] << 1;
-                    break;
-//                case 4: // ridiculously high quality
-//                    pBuf[iOffset++] = quant95_color[i];
-//                    break;
-            }
+            pBuf[iOffset++] = JPEGScaleQuant(quant_color[i], iQScale);
         }
     }
     // store the restart interval
@@ -920,6 +1092,7 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
     iOffset += 2;
     WRITEMOTO16(pBuf, iOffset, 4); // fixed length of 4
     iOffset += 2;
+    pJPEG->iDRIOffset = iOffset;
     WRITEMOTO16(pBuf, iOffset, i); // restart interval count
     iOffset += 2;
 
@@ -931,6 +1104,7 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
         pBuf[iOffset++] = 0;
         pBuf[iOffset++] = 11; // length = 11
         pBuf[iOffset++] = 8;   // sample precision
+        pJPEG->iSOFOffset = iOffset;
         WRITEMOTO16(pBuf, iOffset, pJPEG->iHeight); // image height
         iOffset += 2;
         WRITEMOTO16(pBuf, iOffset, pJPEG->iWidth); // image width
@@ -945,6 +1119,7 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
         pBuf[iOffset++] = 0;
         pBuf[iOffset++] = 17; // length = 17
         pBuf[iOffset++] = 8;   // sample precision
+        pJPEG->iSOFOffset = iOffset;
         WRITEMOTO16(pBuf, iOffset, pJPEG->iHeight); // image height
         iOffset += 2;
         WRITEMOTO16(pBuf, iOffset, pJPEG->iWidth); // image width
@@ -967,39 +1142,21 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
         WRITEMOTO16(pBuf, iOffset, 0x1101); // subsampling and quant table selector
         iOffset += 2;
     }
-    // define Huffman tables
-    WRITEMOTO16(pBuf, iOffset, 0xffc4); // Huffman DC table
-    iOffset += 2;
-    WRITEMOTO16(pBuf, iOffset, 0x1f); // Table length = 31
-    iOffset += 2;
-    pBuf[iOffset++] = 0; // table class = 0 (DC), id = 0
-    memcpy(&pBuf[iOffset], huffl_dc, 28); // copy DC table
-    iOffset += 28;
-    // now the AC table
-    WRITEMOTO16(pBuf, iOffset, 0xffc4); // Huffman AC table
-    iOffset += 2;
-    WRITEMOTO16(pBuf, iOffset, 0xb5); // Table length = 181
-    iOffset += 2;
-    pBuf[iOffset++] = 0x10; // table class = 1 (AC), id = 0
-    memcpy(&pBuf[iOffset], huffl_ac, 178); // copy AC table
-    iOffset += 178;
-    if (pJPEG->ucPixelType != JPEGE_PIXEL_GRAYSCALE) // define a second set of tables for color
+    // define Huffman tables, DC and AC for luma and then for chroma
+    for (i = 0; i < ((pJPEG->ucPixelType == JPEGE_PIXEL_GRAYSCALE) ? 2 : 4); i++)
     {
-        WRITEMOTO16(pBuf, iOffset, 0xffc4); // Huffman DC table
-        iOffset += 2;
-        WRITEMOTO16(pBuf, iOffset, 0x1f); // Table length = 31
-        iOffset += 2;
-        pBuf[iOffset++] = 1; // table class = 0 (DC), id = 1
-        memcpy(&pBuf[iOffset], huffcr_dc, 28); // copy DC table
-        iOffset += 28;
-        // now the AC table
-        WRITEMOTO16(pBuf, iOffset, 0xffc4); // Huffman AC table
+        const uint8_t *pSpec = JPEGGetHuffSpec(pJPEG, i);
+        int j, iCount = 0;
+
+        for (j = 0; j < 16; j++)
+            iCount += pSpec[j];
+        WRITEMOTO16(pBuf, iOffset, 0xffc4); // Huffman table marker
         iOffset += 2;
-        WRITEMOTO16(pBuf, iOffset, 0xb5); // Table length = 181
+        WRITEMOTO16(pBuf, iOffset, 19 + iCount); // Table length, 31 (DC) or 181 (AC) for Annex K
         iOffset += 2;
-        pBuf[iOffset++] = 0x11; // table class = 1 (AC), id = 1
-        memcpy(&pBuf[iOffset], huffcr_ac, 178); // copy AC table
-        iOffset += 178;
+        pBuf[iOffset++] = ((i & 1) << 4) | (i >> 1); // table class (0 = DC, 1 = AC) and id
+        memcpy(&pBuf[iOffset], pSpec, 16 + iCount); // copy the table
+        iOffset += 16 + iCount;
     }
     // Define the start of scan header (SOS)
     WRITEMOTO16(pBuf, iOffset, 0xffda); // SOS
@@ -1029,39 +1186,21 @@ int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHe
     pBuf[iOffset++] = 0; // successive approximation bit
     // Set the output pointer for writing the variable length codes
     pJPEG->pc.pOut = &pBuf[iOffset];
+    // Keep a copy so that the following frames can skip all of the above
+    pJPEG->iHeaderSize = iOffset;
+    memcpy(pJPEG->ucHeader, pBuf, iOffset);
 
     // prepare the luma & chroma quantization tables
     for (i = 0; i<64; i++)
     {
-        switch (ucQFactor)
-        {
-            case JPEGE_Q_BEST:
-                pJPEG->sQuantTable[i] = quant_lum[i] >> 2;
-                pJPEG->sQuantTable[i + 64] = quant_color[i] >> 2;
-                break;
-            case JPEGE_Q_HIGH:
-                pJPEG->sQuantTable[i] = (quant_lum[i] >> 1);
-                pJPEG->sQuantTable[i + 64] = (quant_color[i] >> 1);
-                break;
-            case JPEGE_Q_MED:
-                pJPEG->sQuantTable[i] = quant_lum[i];
-                pJPEG->sQuantTable[i + 64] = quant_color[i];
-                break;
-            case JPEGE_Q_LOW:
-                pJPEG->sQuantTable[i] = (quant_lum[i] << 1);
-                pJPEG->sQuantTable[i + 64] = (quant_color[i] << 1);
-                break;
-//            case 4: // ridiculous quality
-//                pJPEG->sQuantTable[i] = quant95_lum[i];
-//                pJPEG->sQuantTable[i + 64] = quant95_color[i];
-//                break;
-        }
+        pJPEG->sQuantTable[i] = JPEGScaleQuant(quant_lum[i], iQScale);
+        pJPEG->sQuantTable[i + 64] = JPEGScaleQuant(quant_color[i], iQScale);
     }
     JPEGFixQuantE(pJPEG); // reorder and scale quant table(s)
     JPEGMakeHuffE(pJPEG); // create the Huffman tables to encode
     pJPEG->iError = JPEGE_SUCCESS;
     return JPEGE_SUCCESS;
-} /* JPEGEncodeBegin() */
+} /* JPEGEncodeBeginScaled() */
 
 int JPEGQuantize(JPEGE_IMAGE *pJPEG, signed short *pMCUSrc, int iTable)
 {
@@ -1123,6 +1262,7 @@ int JPEGEncodeMCU(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int
     BIGUINT ulAcc;
     uint32_t ulMagVal;
     uint32_t *pMagFix = (uint32_t *)&ulMagnitudeFix[1024]; // allows indexing positive and negative values - speeds up total encode time by 15%
+    JPEGE_HUFF_STATS *pStats = pJPEG->pHuffStats;
 
     // Put in local vars to allow compiler to do a better job of optimization using registers
     ulAcc = pJPEG->pc.ulAcc;
@@ -1147,6 +1287,8 @@ int JPEGEncodeMCU(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int
     //      {
     //      cMagnitude = cMagnitudes[iDelta];
     //      }
+    if (pStats)
+        pStats->u32DC[iDCTable][cMagnitude]++;
     ulCode = (BIGUINT) pHuff[cMagnitude];
     iNewLen = pHuff[cMagnitude + 256];
     ulCode = (ulCode << cMagnitude) | iDelta; // code in msb, followed by delta
@@ -1168,6 +1310,8 @@ int JPEGEncodeMCU(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int
         }
         if (pZig == pZigEnd) // special case, no more coefficients
         { // encode EOB (end of block)
+            if (pStats)
+                pStats->u32AC[iDCTable][0]++;
             ulCode = (BIGUINT) pHuff[0];
             iNewLen = pHuff[256];
             STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
@@ -1178,6 +1322,8 @@ int JPEGEncodeMCU(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int
             iZeroCount = (int)(pZig - pZigStart);
             while (iZeroCount >= 16)  // maximum that can be encoded at once
             { // 16 zeros is called ZRL (f0)
+                if (pStats)
+                    pStats->u32AC[iDCTable][0xf0]++;
                 ulCode = (uint32_t)pHuff[0xf0];
                 iNewLen = pHuff[256 + 0xf0];
                 STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
@@ -1188,6 +1334,8 @@ int JPEGEncodeMCU(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int
             iDelta = (ulMagVal >> 16);
             cMagnitude = ulMagVal & 0xf;
             ucCode = (unsigned char)((iZeroCount << 4) | cMagnitude); // combine zero count and 'extra' size
+            if (pStats)
+                pStats->u32AC[iDCTable][ucCode]++;
             // store the huffman code
             ulCode = (uint32_t)pHuff[ucCode];
             iNewLen = pHuff[256 + ucCode];
@@ -1206,6 +1354,93 @@ encodemcuz:
 
 } /* JPEGEncodeMCU() */
 
+#ifdef JPEGE_SIMD
+//
+// Same output as JPEGEncodeMCU(), but the AC loop walks the nonzero
+// coefficients from a bitmask in zigzag order (from JPEGFDCTQuantVec())
+// instead of testing all of them; zero runs come from the bit distance.
+//
+int JPEGEncodeMCUMask(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int iDCPred, uint64_t u64Mask)
+{
+    unsigned char cMagnitude;
+    unsigned char ucCode;
+    int iZeroCount, iPos, iLast;
+    BIGINT iDelta;
+    BIGUINT iLen, iNewLen;
+    unsigned short *pHuff;
+    BIGUINT ulCode;
+    unsigned char *pOut;
+    BIGUINT ulAcc;
+    uint32_t ulMagVal;
+    uint32_t *pMagFix = (uint32_t *)&ulMagnitudeFix[1024];
+    JPEGE_HUFF_STATS *pStats = pJPEG->pHuffStats;
+
+    ulAcc = pJPEG->pc.ulAcc;
+    pOut = pJPEG->pc.pOut;
+    iLen = pJPEG->pc.iLen;
+
+    // compress the DC component
+    iDelta = pMCUData[0] - iDCPred;
+    iDCPred = pMCUData[0]; // this is the new DC value
+    pHuff = (unsigned short *) pJPEG->huffdc[iDCTable];
+    ulMagVal = pMagFix[iDelta];
+    iDelta = (ulMagVal >> 16);
+    cMagnitude = ulMagVal & 0xf;
+    if (pStats)
+        pStats->u32DC[iDCTable][cMagnitude]++;
+    ulCode = (BIGUINT) pHuff[cMagnitude];
+    iNewLen = pHuff[cMagnitude + 256];
+    ulCode = (ulCode << cMagnitude) | iDelta; // code in msb, followed by delta
+    iNewLen += cMagnitude; // add lengths together
+    STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+    // Encode the AC components
+    pHuff += 512; // point to AC table
+    u64Mask &= ~1ULL; // DC is done
+    iLast = 0;
+    while (u64Mask)
+    {
+        iPos = __builtin_ctzll(u64Mask);
+        u64Mask &= u64Mask - 1;
+        iZeroCount = iPos - iLast - 1;
+        iLast = iPos;
+        while (iZeroCount >= 16)  // maximum that can be encoded at once
+        { // 16 zeros is called ZRL (f0)
+            if (pStats)
+                pStats->u32AC[iDCTable][0xf0]++;
+            ulCode = (uint32_t)pHuff[0xf0];
+            iNewLen = pHuff[256 + 0xf0];
+            STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+            iZeroCount -= 16;
+        }
+        // Encode a normal RRRR/SSSS pair
+        ulMagVal = pMagFix[pMCUData[cZigZag2[iPos]]];
+        iDelta = (ulMagVal >> 16);
+        cMagnitude = ulMagVal & 0xf;
+        ucCode = (unsigned char)((iZeroCount << 4) | cMagnitude);
+        if (pStats)
+            pStats->u32AC[iDCTable][ucCode]++;
+        ulCode = (uint32_t)pHuff[ucCode];
+        iNewLen = pHuff[256 + ucCode];
+        ulCode = (ulCode << cMagnitude) | iDelta; // code followed by magnitude
+        iNewLen += cMagnitude;
+        STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+    }
+    if (iLast != 63) // encode EOB (end of block)
+    {
+        if (pStats)
+            pStats->u32AC[iDCTable][0]++;
+        ulCode = (BIGUINT) pHuff[0];
+        iNewLen = pHuff[256];
+        STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+    }
+
+    pJPEG->pc.ulAcc = ulAcc;
+    pJPEG->pc.pOut = pOut;
+    pJPEG->pc.iLen = iLen;
+    return iDCPred;
+} /* JPEGEncodeMCUMask() */
+#endif // JPEGE_SIMD
+
 void JPEGGetMCU(unsigned char *pSrc, int iPitch, signed char *pMCU)
 {
     int cy;
@@ -1354,7 +1589,11 @@ void JPEGSubSample16(unsigned char *pSrc, signed char *pLUM, signed char *pCb, s
 
 } /* JPEGSubSample16() */
 
-void JPEGSubSample32(unsigned char *pSrc, signed char *pLUM, signed char *pCb, signed char *pCr, int lsize, int cx, int cy)
+//
+// iRed is the byte offset of red in the pixel, 0 for R,G,B,A and 2 for
+// B,G,R,X; blue is at the other end
+//
+void JPEGSubSample32(unsigned char *pSrc, signed char *pLUM, signed char *pCb, signed char *pCr, int lsize, int cx, int cy, int iRed)
 {
     int x;
     unsigned char cRed, cGreen, cBlue;
@@ -1368,30 +1607,30 @@ void JPEGSubSample32(unsigned char *pSrc, signed char *pLUM, signed char *pCb, s
     {
         for (x=0; x<cx; x++) // do 8x8 pixels in 2x2 blocks
         {
-            cRed = pSrc[0];
+            cRed = pSrc[iRed];
             cGreen = pSrc[1];
-            cBlue = pSrc[2];
+            cBlue = pSrc[iRed ^ 2];
             iY1 = (((cRed * 1225) + (cGreen * 2404) + (cBlue * 467)) >> 12) - 0x80;
             iCb1 = (cBlue << 11) + (cRed * -691) + (cGreen * -1357);
             iCr1 = (cRed << 11) + (cGreen * -1715) + (cBlue * -333);
 
-            cRed = pSrc[4];
+            cRed = pSrc[4 + iRed];
             cGreen = pSrc[5];
-            cBlue = pSrc[6];
+            cBlue = pSrc[4 + (iRed ^ 2)];
             iY2 = (((cRed * 1225) + (cGreen * 2404) + (cBlue * 467)) >> 12) - 0x80;
             iCb2 = (cBlue << 11) + (cRed * -691) + (cGreen * -1357);
             iCr2 = (cRed << 11) + (cGreen * -1715) + (cBlue * -333);
 
-            cRed = pSrc[lsize+0];
+            cRed = pSrc[lsize+iRed];
             cGreen = pSrc[lsize+1];
-            cBlue = pSrc[lsize+2];
+            cBlue = pSrc[lsize+(iRed ^ 2)];
             iY3 = (((cRed * 1225) + (cGreen * 2404) + (cBlue * 467)) >> 12) - 0x80;
             iCb3 = (cBlue << 11) + (cRed * -691) + (cGreen * -1357);
             iCr3 = (cRed << 11) + (cGreen * -1715) + (cBlue * -333);
 
-            cRed = pSrc[lsize+4];
+            cRed = pSrc[lsize+4+iRed];
             cGreen = pSrc[lsize+5];
-            cBlue = pSrc[lsize+6];
+            cBlue = pSrc[lsize+4+(iRed ^ 2)];
             iY4 = (((cRed * 1225) + (cGreen * 2404) + (cBlue * 467)) >> 12) - 0x80;
             iCb4 = (cBlue << 11) + (cRed * -691) + (cGreen * -1357);
             iCr4 = (cRed << 11) + (cGreen * -1715) + (cBlue * -333);
@@ -1420,7 +1659,7 @@ void JPEGSubSample32(unsigned char *pSrc, signed char *pLUM, signed char *pCb, s
 
 } /* JPEGSubSample32() */
 
-void JPEGSample32(unsigned char *pSrc, signed char *pMCU, int lsize, int cx, int cy)
+void JPEGSample32(unsigned char *pSrc, signed char *pMCU, int lsize, int cx, int cy, int iRed)
 {
     int x, y;
     unsigned char cRed, cGreen, cBlue;
@@ -1430,9 +1669,9 @@ void JPEGSample32(unsigned char *pSrc, signed char *pMCU, int lsize, int cx, int
     {
         for (x=0; x<cx; x++) // do 8x8 pixels
         {
-            cRed = pSrc[0];
+            cRed = pSrc[iRed];
             cGreen = pSrc[1];
-            cBlue = pSrc[2];
+            cBlue = pSrc[iRed ^ 2];
             pSrc += 4;
             iY = (((cRed * 1225) + (cGreen * 2404) + (cBlue * 467)) >> 12) - 0x80;
             iCb = (cBlue << 11) + (cRed * -691) + (cGreen * -1357);
@@ -1552,6 +1791,16 @@ void JPEGGetMCU22(unsigned char *pImage, JPEGE_IMAGE *pPage, int iPitch)
     {
         JPEGSubSampleYUV422(pImage, pMCUData, iPitch);
     }
+#ifdef JPEGE_SIMD
+    else if (pPage->ucSIMD && pPage->ucPixelType == JPEGE_PIXEL_RGB565)
+    {
+        JPEGSubSample16Vec(pImage, pMCUData, iPitch);
+    }
+    else if (pPage->ucSIMD && pPage->ucPixelType == JPEGE_PIXEL_XRGB8888)
+    {
+        JPEGSubSample32Vec(pImage, pMCUData, iPitch);
+    }
+#endif
     else if (pPage->ucPixelType == JPEGE_PIXEL_RGB565)
     {
         // upper left
@@ -1584,20 +1833,21 @@ void JPEGGetMCU22(unsigned char *pImage, JPEGE_IMAGE *pPage, int iPitch)
                 JPEGSubSample24(pImage+8*iPitch + 8*3, &pMCUData[DCTSIZE*3], &pMCUData[36+DCTSIZE*4], &pMCUData[36+DCTSIZE*5], iPitch, width - 8, height - 8);
         }
     }
-    else if (pPage->ucPixelType == JPEGE_PIXEL_ARGB8888)
+    else if (pPage->ucPixelType == JPEGE_PIXEL_ARGB8888 || pPage->ucPixelType == JPEGE_PIXEL_XRGB8888)
     {
+        int iRed = (pPage->ucPixelType == JPEGE_PIXEL_XRGB8888) ? 2 : 0;
         // upper left
-        JPEGSubSample32(pImage, pMCUData, &pMCUData[DCTSIZE*4], &pMCUData[DCTSIZE*5], iPitch, cx, cy);
+        JPEGSubSample32(pImage, pMCUData, &pMCUData[DCTSIZE*4], &pMCUData[DCTSIZE*5], iPitch, cx, cy, iRed);
         // upper right
         if (width > 8)
-            JPEGSubSample32(pImage+8*4, &pMCUData[DCTSIZE*1], &pMCUData[4+DCTSIZE*4], &pMCUData[4+DCTSIZE*5], iPitch, width-8, cy);
+            JPEGSubSample32(pImage+8*4, &pMCUData[DCTSIZE*1], &pMCUData[4+DCTSIZE*4], &pMCUData[4+DCTSIZE*5], iPitch, width-8, cy, iRed);
         if (height > 8)
         {
             // lower left
-            JPEGSubSample32(pImage+8*iPitch, &pMCUData[DCTSIZE*2], &pMCUData[32+DCTSIZE*4], &pMCUData[32+DCTSIZE*5], iPitch, cx, height - 8);
+            JPEGSubSample32(pImage+8*iPitch, &pMCUData[DCTSIZE*2], &pMCUData[32+DCTSIZE*4], &pMCUData[32+DCTSIZE*5], iPitch, cx, height - 8, iRed);
             // lower right
             if (width > 8)
-                JPEGSubSample32(pImage+8*iPitch + 8*4, &pMCUData[DCTSIZE*3], &pMCUData[36+DCTSIZE*4], &pMCUData[36+DCTSIZE*5], iPitch, width - 8, height - 8);
+                JPEGSubSample32(pImage+8*iPitch + 8*4, &pMCUData[DCTSIZE*3], &pMCUData[36+DCTSIZE*4], &pMCUData[36+DCTSIZE*5], iPitch, width - 8, height - 8, iRed);
         }
     }
 } /* JPEGGetMCU22() */
@@ -1695,7 +1945,7 @@ void JPEGGetMCU11(unsigned char *pImage, JPEGE_IMAGE *pPage, int iPitch)
     else if (pPage->ucPixelType == JPEGE_PIXEL_RGB565)
         JPEGSample16(pImage, pMCUData, iPitch, cx, cy);
     else // must be 32-bpp
-        JPEGSample32(pImage, pMCUData, iPitch, cx, cy);
+        JPEGSample32(pImage, pMCUData, iPitch, cx, cy, (pPage->ucPixelType == JPEGE_PIXEL_XRGB8888) ? 2 : 0);
 
 } /* JPEGGetMCU11() */
 
@@ -1798,9 +2048,120 @@ void FlushCode(PIL_CODE *pPC)
     pPC->iLen = 0;
 } /* FlushCode() */
 
-int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch)
+//
+// Solid backgrounds give blocks of 64 equal samples; compare 8 at a time
+// against the first one. Most detailed blocks fail on the first row.
+//
+static int JPEGIsFlat(signed char *pMCUSrc)
+{
+    uint64_t u64Row, u64Flat;
+    int i;
+
+    u64Flat = (uint8_t)pMCUSrc[0] * 0x0101010101010101ULL;
+    for (i=0; i<64; i+=8)
+    {
+        memcpy(&u64Row, &pMCUSrc[i], sizeof(u64Row));
+        if (u64Row != u64Flat)
+            return 0;
+    }
+    return 1;
+} /* JPEGIsFlat() */
+
+//
+// Quantized DC of a flat block: the FDCT of 64 samples of value v is 64*v
+// at DC and 0 elsewhere, rounded the way JPEGQuantize() does it
+//
+static int JPEGQuantizeFlat(JPEGE_IMAGE *pJPEG, int iValue, int iTable)
+{
+    signed short *pQuant = &pJPEG->sQuantTable[iTable * DCTSIZE];
+    signed int d = iValue * 64, sQ2 = pQuant[0] >> 1;
+
+    if (d < 0)
+        return 0 - (((sQ2 - d) * pQuant[128]) >> 16);
+    return ((sQ2 + d) * pQuant[128]) >> 16;
+} /* JPEGQuantizeFlat() */
+
+//
+// Entropy code a block with only a DC coefficient: the DC difference
+// followed by an immediate EOB. Returns the new DC predictor.
+//
+static int JPEGEncodeDC(int iDCTable, JPEGE_IMAGE *pJPEG, int iDC, int iDCPred)
+{
+    unsigned char cMagnitude;
+    BIGINT iDelta;
+    BIGUINT iLen, iNewLen;
+    unsigned short *pHuff;
+    BIGUINT ulCode;
+    unsigned char *pOut;
+    BIGUINT ulAcc;
+    uint32_t ulMagVal;
+    uint32_t *pMagFix = (uint32_t *)&ulMagnitudeFix[1024];
+    JPEGE_HUFF_STATS *pStats = pJPEG->pHuffStats;
+
+    ulAcc = pJPEG->pc.ulAcc;
+    pOut = pJPEG->pc.pOut;
+    iLen = pJPEG->pc.iLen;
+
+    pHuff = (unsigned short *) pJPEG->huffdc[iDCTable];
+    ulMagVal = pMagFix[iDC - iDCPred];
+    iDelta = (ulMagVal >> 16);
+    cMagnitude = ulMagVal & 0xf;
+    if (pStats) {
+        pStats->u32DC[iDCTable][cMagnitude]++;
+        pStats->u32AC[iDCTable][0]++; // EOB
+    }
+    ulCode = (BIGUINT) pHuff[cMagnitude];
+    iNewLen = pHuff[cMagnitude + 256];
+    ulCode = (ulCode << cMagnitude) | iDelta; // code in msb, followed by delta
+    iNewLen += cMagnitude; // add lengths together
+    STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+    pHuff += 512; // point to AC table
+    ulCode = (BIGUINT) pHuff[0]; // EOB
+    iNewLen = pHuff[256];
+    STORECODE(pOut, iLen, ulCode, ulAcc, iNewLen)
+
+    pJPEG->pc.ulAcc = ulAcc;
+    pJPEG->pc.pOut = pOut;
+    pJPEG->pc.iLen = iLen;
+    return iDC;
+} /* JPEGEncodeDC() */
+
+//
+// Transform, quantize and entropy code block iBlock of the MCU; returns
+// the new DC predictor. Flat blocks skip straight to a DC-only code, with
+// the same output the transform would have given.
+//
+static int JPEGCodeBlock(JPEGE_IMAGE *pJPEG, int iBlock, int iTable, int iDCPred)
 {
+    signed char *pMCUSrc = &pJPEG->MCUc[iBlock*DCTSIZE];
     int bSparse;
+    JPEGE_PROFILE_START(t);
+    if (JPEGIsFlat(pMCUSrc)) {
+        iDCPred = JPEGEncodeDC(iTable, pJPEG, JPEGQuantizeFlat(pJPEG, pMCUSrc[0], iTable), iDCPred);
+        JPEGE_PROFILE_STOP(t, JPEGE_STAGE_HUFFMAN);
+        return iDCPred;
+    }
+#ifdef JPEGE_SIMD
+    if (pJPEG->ucSIMD) {
+        uint64_t u64Mask = JPEGFDCTQuantVec(pMCUSrc, pJPEG->MCUs, &pJPEG->sQuantTable[iTable*DCTSIZE]);
+        JPEGE_PROFILE_STOP(t, JPEGE_STAGE_FDCT); // quantize is folded in
+        iDCPred = JPEGEncodeMCUMask(iTable, pJPEG, pJPEG->MCUs, iDCPred, u64Mask);
+        JPEGE_PROFILE_STOP(t, JPEGE_STAGE_HUFFMAN);
+        return iDCPred;
+    }
+#endif
+    JPEGFDCT(pMCUSrc, pJPEG->MCUs);
+    JPEGE_PROFILE_STOP(t, JPEGE_STAGE_FDCT);
+    bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, iTable);
+    JPEGE_PROFILE_STOP(t, JPEGE_STAGE_QUANTIZE);
+    iDCPred = JPEGEncodeMCU(iTable, pJPEG, pJPEG->MCUs, iDCPred, bSparse);
+    JPEGE_PROFILE_STOP(t, JPEGE_STAGE_HUFFMAN);
+    return iDCPred;
+} /* JPEGCodeBlock() */
+
+int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch)
+{
+    JPEGE_PROFILE_START(t);
 
     if (pEncode->y >= pJPEG->iHeight) {
         // the image is already complete or was not initialized properly
@@ -1809,9 +2170,8 @@ int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iP
     }
     if (pJPEG->ucPixelType == JPEGE_PIXEL_GRAYSCALE) {
         JPEGGetMCU(pPixels, iPitch, pJPEG->MCUc);
-        JPEGFDCT(pJPEG->MCUc, pJPEG->MCUs);
-        bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-        pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
+        JPEGE_PROFILE_STOP(t, JPEGE_STAGE_CONVERT);
+        pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 0, 0, pJPEG->iDCPred0);
         if (pEncode->x >= (pJPEG->iWidth - pEncode->cx)) { // end of the row?
             // Store the restart marker
             FlushCode(&pJPEG->pc);
@@ -1830,38 +2190,19 @@ int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iP
     } else { // color
         if (pJPEG->ucSubSample == JPEGE_SUBSAMPLE_444) {
             JPEGGetMCU11(pPixels, pJPEG, iPitch);
-            JPEGFDCT(&pJPEG->MCUc[0*DCTSIZE], pJPEG->MCUs);
-            // Y
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-            pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[1*DCTSIZE], pJPEG->MCUs);
-            // Cb
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 1);
-            pJPEG->iDCPred1 = JPEGEncodeMCU(1, pJPEG, pJPEG->MCUs, pJPEG->iDCPred1, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[2*DCTSIZE], pJPEG->MCUs);
-            // Cr
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 1);
-            pJPEG->iDCPred2 = JPEGEncodeMCU(1, pJPEG, pJPEG->MCUs, pJPEG->iDCPred2, bSparse);
+            JPEGE_PROFILE_STOP(t, JPEGE_STAGE_CONVERT);
+            pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 0, 0, pJPEG->iDCPred0); // Y
+            pJPEG->iDCPred1 = JPEGCodeBlock(pJPEG, 1, 1, pJPEG->iDCPred1); // Cb
+            pJPEG->iDCPred2 = JPEGCodeBlock(pJPEG, 2, 1, pJPEG->iDCPred2); // Cr
         } else { // must be 420
             JPEGGetMCU22(pPixels, pJPEG, iPitch);
-            JPEGFDCT(&pJPEG->MCUc[0*DCTSIZE], pJPEG->MCUs); // Y0
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-            pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[1*DCTSIZE], pJPEG->MCUs); // Y1
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-            pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[2*DCTSIZE], pJPEG->MCUs); // Y2
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-            pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[3*DCTSIZE], pJPEG->MCUs); // Y3
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 0);
-            pJPEG->iDCPred0 = JPEGEncodeMCU(0, pJPEG, pJPEG->MCUs, pJPEG->iDCPred0, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[4*DCTSIZE], pJPEG->MCUs); // Cb
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 1);
-            pJPEG->iDCPred1 = JPEGEncodeMCU(1, pJPEG, pJPEG->MCUs, pJPEG->iDCPred1, bSparse);
-            JPEGFDCT(&pJPEG->MCUc[5*DCTSIZE], pJPEG->MCUs); // Cr
-            bSparse = JPEGQuantize(pJPEG, pJPEG->MCUs, 1);
-            pJPEG->iDCPred2 = JPEGEncodeMCU(1, pJPEG, pJPEG->MCUs, pJPEG->iDCPred2, bSparse);
+            JPEGE_PROFILE_STOP(t, JPEGE_STAGE_CONVERT);
+            pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 0, 0, pJPEG->iDCPred0); // Y0
+            pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 1, 0, pJPEG->iDCPred0); // Y1
+            pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 2, 0, pJPEG->iDCPred0); // Y2
+            pJPEG->iDCPred0 = JPEGCodeBlock(pJPEG, 3, 0, pJPEG->iDCPred0); // Y3
+            pJPEG->iDCPred1 = JPEGCodeBlock(pJPEG, 4, 1, pJPEG->iDCPred1); // Cb
+            pJPEG->iDCPred2 = JPEGCodeBlock(pJPEG, 5, 1, pJPEG->iDCPred2); // Cr
         } // 420 subsample
         if (pEncode->x >= (pJPEG->iWidth - pEncode->cx)) { // end of the row?
             // Store the restart marker
@@ -1893,11 +2234,37 @@ int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iP
     return JPEGE_SUCCESS;
 } /* JPEGAddMCU() */
 
-int JPEGAddFrame(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch)
+//
+// The vector code paths need the FPU/NEON registers, which the kernel
+// only lends out between kernel_fpu_begin() and kernel_fpu_end(). The
+// section is taken once per MCU row to keep the preemption-off time short.
+//
+static void JPEGVecBegin(JPEGE_IMAGE *pJPEG)
+{
+#ifdef JPEGE_SIMD
+    if (pJPEG->ucSIMD)
+        kernel_fpu_begin();
+#endif
+} /* JPEGVecBegin() */
+
+static void JPEGVecEnd(JPEGE_IMAGE *pJPEG)
+{
+#ifdef JPEGE_SIMD
+    if (pJPEG->ucSIMD)
+        kernel_fpu_end();
+#endif
+} /* JPEGVecEnd() */
+
+static void JPEGVecInit(JPEGE_IMAGE *pJPEG)
+{
+    pJPEG->ucSIMD = 0;
+#ifdef JPEGE_SIMD
+    pJPEG->ucSIMD = kernel_fpu_available();
+#endif
+} /* JPEGVecInit() */
+
+static int JPEGBytesPerMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode)
 {
-int x, y;
-uint8_t *s;
-int rc = JPEGE_SUCCESS;
 int iBPMCU;
     iBPMCU = pEncode->cx;
     switch (pJPEG->ucPixelType) {
@@ -1910,22 +2277,74 @@ int iBPMCU;
            iBPMCU *= 3;
            break;
         case JPEGE_PIXEL_ARGB8888:
+        case JPEGE_PIXEL_XRGB8888:
            iBPMCU *= 4;
            break;
         case JPEGE_PIXEL_YUV422:
            iBPMCU *= 2; // average 2 bytes per pixel
            break;
     }
+    return iBPMCU;
+} /* JPEGBytesPerMCU() */
+
+int JPEGAddFrame(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch)
+{
+int x, y;
+uint8_t *s;
+int rc = JPEGE_SUCCESS;
+int iBPMCU;
+    iBPMCU = JPEGBytesPerMCU(pJPEG, pEncode);
+    JPEGVecInit(pJPEG);
     for (y = 0; y < pJPEG->iMCUHeight && rc == JPEGE_SUCCESS; y++) {
         s = &pPixels[y * pEncode->cy * iPitch];
+        JPEGVecBegin(pJPEG);
         for (x = 0; x<pJPEG->iMCUWidth && rc == JPEGE_SUCCESS; x++) {
             rc = JPEGAddMCU(pJPEG, pEncode, s, iPitch);
             s += iBPMCU;
         } // for x
+        JPEGVecEnd(pJPEG);
     } // for y
+    pJPEG->ucSIMD = 0;
     return rc;
 } /* JPEGAddFrame() */
 
+//
+// Encode MCU rows iFirstRow..iFirstRow+iRows-1 into pOutput, without a
+// header. Every row ends with a restart marker and resets the DC
+// predictors, so copies of one JPEGE_IMAGE can encode different rows in
+// parallel and the outputs be appended to the header in row order.
+//
+int JPEGAddRows(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch, int iFirstRow, int iRows)
+{
+int x, y;
+uint8_t *s;
+int rc = JPEGE_SUCCESS;
+int iBPMCU;
+    if (iFirstRow < 0 || iFirstRow + iRows > pJPEG->iMCUHeight || pJPEG->pOutput == NULL) {
+        return JPEGE_INVALID_PARAMETER;
+    }
+    pJPEG->iDCPred0 = pJPEG->iDCPred1 = pJPEG->iDCPred2 = 0;
+    pJPEG->iRestart = iFirstRow; // keeps the RSTn numbering of a whole frame
+    pJPEG->pc.iLen = pJPEG->pc.ulAcc = 0;
+    pJPEG->pc.pOut = pJPEG->pOutput;
+    pJPEG->iError = JPEGE_SUCCESS;
+    pEncode->x = 0;
+    pEncode->y = iFirstRow * pEncode->cy;
+    iBPMCU = JPEGBytesPerMCU(pJPEG, pEncode);
+    JPEGVecInit(pJPEG);
+    for (y = iFirstRow; y < iFirstRow + iRows && rc == JPEGE_SUCCESS; y++) {
+        s = &pPixels[y * pEncode->cy * iPitch];
+        JPEGVecBegin(pJPEG);
+        for (x = 0; x<pJPEG->iMCUWidth && rc == JPEGE_SUCCESS; x++) {
+            rc = JPEGAddMCU(pJPEG, pEncode, s, iPitch);
+            s += iBPMCU;
+        } // for x
+        JPEGVecEnd(pJPEG);
+    } // for y
+    pJPEG->ucSIMD = 0;
+    return rc;
+} /* JPEGAddRows() */
+
 int JPEGGetLastError(JPEGE_IMAGE *pJPEG)
 {
     return pJPEG->iError;
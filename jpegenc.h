@@ -45,6 +45,7 @@
 
 /* Defines and variables */
 #define JPEGE_FILE_BUF_SIZE 2048
+#define JPEGE_HEADER_SIZE 640 // largest header JPEGEncodeBegin() can write (629 bytes for color)
 
 #ifndef DCTSIZE
 #define DCTSIZE 64
@@ -92,6 +93,28 @@ uint32_t ulAcc; // code accumulator (holds codes until at least 32-bits ready to
         iLen += iNewLen; ulAcc |= (ulCode << (32-iLen));
 #endif
 
+//
+// Per-stage time accounting for the userspace benchmark (bench/); the
+// kernel build compiles it out.
+//
+#ifdef JPEGE_PROFILE
+enum {
+    JPEGE_STAGE_CONVERT = 0,
+    JPEGE_STAGE_FDCT,
+    JPEGE_STAGE_QUANTIZE,
+    JPEGE_STAGE_HUFFMAN,
+    JPEGE_STAGE_COUNT
+};
+extern uint64_t JPEGStageTicks[JPEGE_STAGE_COUNT];
+uint64_t JPEGProfileTicks(void);
+#define JPEGE_PROFILE_START(t) uint64_t t = JPEGProfileTicks()
+#define JPEGE_PROFILE_STOP(t, stage) do { uint64_t _u = JPEGProfileTicks(); \
+    __atomic_fetch_add(&JPEGStageTicks[stage], _u - t, __ATOMIC_RELAXED); t = _u; } while (0)
+#else
+#define JPEGE_PROFILE_START(t)
+#define JPEGE_PROFILE_STOP(t, stage)
+#endif
+
 #define WRITEMOTO32(p, o, val) {uint32_t l = val; p[o] = (unsigned char)(l >> 24); p[o+1] = (unsigned char)(l >> 16); p[o+2] = (unsigned char)(l >> 8); p[o+3] = (unsigned char)l;}
 #define WRITEMOTO16(p, o, val) {uint32_t l = val; p[o] = (unsigned char)(l >> 8); p[o+1] = (unsigned char)l;}
 
@@ -118,6 +141,7 @@ enum {
     JPEGE_PIXEL_RGB888,
     JPEGE_PIXEL_ARGB8888,
     JPEGE_PIXEL_YUV422,
+    JPEGE_PIXEL_XRGB8888, // DRM_FORMAT_XRGB8888, bytes B,G,R,X
     JPEGE_PIXEL_COUNT
 };
 // Compression quality
@@ -127,6 +151,34 @@ enum {
     JPEGE_Q_MED,
     JPEGE_Q_LOW
 };
+// The same qualities expressed as a scale (in percent) of the Annex K tables
+#define JPEGE_QSCALE_BEST 25
+#define JPEGE_QSCALE_HIGH 50
+#define JPEGE_QSCALE_MED 100
+#define JPEGE_QSCALE_LOW 200
+#define JPEGE_QSCALE_MAX 1600
+
+// A Huffman table as it is stored in a DHT segment: the number of codes
+// of each length from 1 to 16 bits, then the symbols in code order
+#define JPEGE_HUFF_SPEC_SIZE (16+256)
+
+// Symbol counts of the luma (0) and chroma (1) tables, for building
+// tables that fit the image content
+typedef struct jpege_huff_stats_tag
+{
+    uint32_t u32DC[2][16];
+    uint32_t u32AC[2][256];
+} JPEGE_HUFF_STATS;
+
+// Scratch space of JPEGMakeHuffSpec(), too big for a kernel stack
+typedef struct jpege_huff_work_tag
+{
+    uint32_t u32Freq[513]; // the symbols by frequency, then the merged trees
+    int16_t sParent[513];
+    uint8_t ucDepth[513];
+    uint16_t usSymbol[257];
+    uint8_t ucSize[257]; // code length of each symbol
+} JPEGE_HUFF_WORK;
 
 typedef struct jpege_file_tag
 {
@@ -153,9 +205,11 @@ typedef struct jpege_image_tag
     int x, y; // current MCU x/y
     uint8_t ucPixelType, ucSubSample, ucNumComponents;
     uint8_t ucMemType;
+    uint8_t ucSIMD; // vector MCU code paths, only set inside JPEGAddFrame/Rows
     uint8_t *pOutput, *pHighWater;
     int iBufferSize; // output buffer size provided by caller
     int iHeaderSize; // size of the JPEG header
+    int iSOFOffset, iDRIOffset; // where the image size and restart interval sit in the header
     int iCompressedSize; // size of compressed output
     int iDataSize; // total output file size
     int iPitch; // bytes per line
@@ -164,6 +218,8 @@ typedef struct jpege_image_tag
     int iDCPred0, iDCPred1, iDCPred2; // DC predictor values for the 3 color components
     PIL_CODE pc;
     int *huffdc[2];
+    const uint8_t *pHuffSpec[4]; // Y DC, Y AC, CbCr DC, CbCr AC tables; NULL for Annex K
+    JPEGE_HUFF_STATS *pHuffStats; // symbols are counted here when not NULL
     signed short sQuantTable[DCTSIZE*4];
     signed char MCUc[6*DCTSIZE]; // captured image data
     signed short MCUs[DCTSIZE]; // final processed output
@@ -174,6 +230,8 @@ typedef struct jpege_image_tag
     JPEGE_CLOSE_CALLBACK *pfnClose;
     JPEGE_FILE JPEGFile;
     uint8_t ucFileBuf[JPEGE_FILE_BUF_SIZE]; // holds temp file data
+    uint8_t ucHeader[JPEGE_HEADER_SIZE]; // copy of the header for JPEGEncodeRewind()
+    uint16_t usHuffTable[2][1024]; // codes and lengths built from pHuffSpec
 } JPEGE_IMAGE;
 
 typedef struct jpegencode_t
@@ -206,10 +264,23 @@ class JPEGENC
 int JPEGOpenRAM(JPEGE_IMAGE *pJPEG, uint8_t *pData, int iDataSize);
 int JPEGOpenFile(JPEGE_IMAGE *pJPEG, const char *szFilename);
 int JPEGEncodeBegin(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight, uint8_t ucPixelType, uint8_t ucSubSample, uint8_t ucQFactor);
+int JPEGEncodeBeginScaled(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight, uint8_t ucPixelType, uint8_t ucSubSample, int iQScale);
+int JPEGEncodeRewind(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, int iWidth, int iHeight);
 int JPEGEncodeEnd(JPEGE_IMAGE *pJPEG);
 int JPEGAddMCU(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch);
 int JPEGAddFrame(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch);
+int JPEGAddRows(JPEGE_IMAGE *pJPEG, JPEGENCODE *pEncode, uint8_t *pPixels, int iPitch, int iFirstRow, int iRows);
 int JPEGGetLastError(JPEGE_IMAGE *pJPEG);
+const uint8_t *JPEGGetHuffSpec(JPEGE_IMAGE *pJPEG, int iTable);
+void JPEGMakeHuffSpec(JPEGE_HUFF_WORK *pWork, const uint32_t *pu32Count, int bAC, uint8_t *pSpec);
+uint64_t JPEGHuffCost(const uint8_t *pSpec, const uint32_t *pu32Count, int bAC);
+extern const unsigned char cZigZag[64]; // natural order to zigzag position
+#ifdef JPEGE_SIMD
+void JPEGSubSample16Vec(unsigned char *pSrc, signed char *pMCU, int iPitch);
+void JPEGSubSample32Vec(unsigned char *pSrc, signed char *pMCU, int iPitch);
+uint64_t JPEGFDCTQuantVec(signed char *pMCUSrc, signed short *pMCUDest, signed short *pQuant);
+int JPEGEncodeMCUMask(int iDCTable, JPEGE_IMAGE *pJPEG, signed short *pMCUData, int iDCPred, uint64_t u64Mask);
+#endif
 #endif // __cplusplus
 
 // Due to unaligned memory causing an exception, we have to do these macros the slow way
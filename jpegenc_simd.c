@@ -0,0 +1,223 @@
+//
+// JPEG Encoder - vector color conversion
+//
+// Copyright 2025 embeddedboys, Ltd.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//===========================================================================
+//
+// Built with CC_FLAGS_FPU, so the compiler turns the generic vectors into
+// NEON on arm64 and SSE2 on x86_64. Nothing in here may be called outside
+// a kernel_fpu_begin()/kernel_fpu_end() section.
+//
+#include "jpegenc.h"
+
+typedef int32_t v8si __attribute__((vector_size(32)));
+
+// even and odd lanes of the 16 in a:b
+#ifdef __clang__
+#define JPEGEven(a, b) __builtin_shufflevector(a, b, 0, 2, 4, 6, 8, 10, 12, 14)
+#define JPEGOdd(a, b) __builtin_shufflevector(a, b, 1, 3, 5, 7, 9, 11, 13, 15)
+#else
+#define JPEGEven(a, b) __builtin_shuffle(a, b, (v8si){0, 2, 4, 6, 8, 10, 12, 14})
+#define JPEGOdd(a, b) __builtin_shuffle(a, b, (v8si){1, 3, 5, 7, 9, 11, 13, 15})
+#endif
+
+static inline void JPEGStore8(signed char *d, const v8si *v)
+{
+    int i;
+    for (i=0; i<8; i++)
+        d[i] = (signed char)(*v)[i];
+} /* JPEGStore8() */
+
+// Byte positions of the XRGB8888 channels in a 32-bit load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define JPEG_XRGB_R 8
+#define JPEG_XRGB_G 16
+#define JPEG_XRGB_B 24
+#else
+#define JPEG_XRGB_R 16
+#define JPEG_XRGB_G 8
+#define JPEG_XRGB_B 0
+#endif
+
+//
+// Convert 8 RGB565 or XRGB8888 pixels to Y; same arithmetic as
+// JPEGSubSample16() and JPEGSubSample32() in 32-bit lanes, so the output
+// is bit-exact. Cb and Cr are returned unscaled for the 2x2 average.
+//
+static inline void JPEGConvert8(const unsigned char *p, int bXRGB, signed char *pY, v8si *pCb, v8si *pCr)
+{
+    v8si r, g, b, y;
+
+    if (bXRGB)
+    {
+        const uint32_t *pul = (const uint32_t *)p;
+        v8si ul = {pul[0], pul[1], pul[2], pul[3], pul[4], pul[5], pul[6], pul[7]};
+
+        b = (ul >> JPEG_XRGB_B) & 0xff;
+        g = (ul >> JPEG_XRGB_G) & 0xff;
+        r = (ul >> JPEG_XRGB_R) & 0xff;
+    }
+    else
+    {
+        const uint16_t *pus = (const uint16_t *)p;
+        v8si us = {pus[0], pus[1], pus[2], pus[3], pus[4], pus[5], pus[6], pus[7]};
+
+        b = ((us & 0x1f) << 3) | (us & 7);
+        g = ((us & 0x7e0) >> 3) | ((us & 0x60) >> 5);
+        r = ((us & 0xf800) >> 8) | ((us & 0x3800) >> 11);
+    }
+    y = ((r * 1225 + g * 2404 + b * 467) >> 12) - 0x80;
+    *pCb = (b << 11) - r * 691 - g * 1357;
+    *pCr = (r << 11) - g * 1715 - b * 333;
+    JPEGStore8(pY, &y);
+} /* JPEGConvert8() */
+
+//
+// Full 16x16 MCU to four Y blocks followed by Cb and Cr, in the layout
+// JPEGGetMCU22() produces. bXRGB is a constant in both callers, so each
+// gets its own copy of the loop.
+//
+static inline void JPEGSubSampleVec(unsigned char *pSrc, signed char *pMCU, int iPitch, int bXRGB)
+{
+    v8si cbL, crL, cbR, crR, cb, cr;
+    const unsigned char *p0, *p1;
+    int iBpp = bXRGB ? 4 : 2;
+    signed char *pY;
+    int y;
+
+    for (y=0; y<8; y++) // two source lines per chroma line
+    {
+        p0 = &pSrc[y * 2 * iPitch];
+        p1 = &pSrc[(y * 2 + 1) * iPitch];
+        pY = &pMCU[(y >= 4 ? DCTSIZE*2 : 0) + (y & 3) * 16];
+
+        JPEGConvert8(p0, bXRGB, pY, &cbL, &crL);
+        JPEGConvert8(p1, bXRGB, pY + 8, &cb, &cr);
+        cbL += cb; crL += cr;
+        JPEGConvert8(p0 + 8*iBpp, bXRGB, pY + DCTSIZE, &cbR, &crR);
+        JPEGConvert8(p1 + 8*iBpp, bXRGB, pY + DCTSIZE + 8, &cb, &cr);
+        cbR += cb; crR += cr;
+
+        // add horizontal pairs of the two vertical sums
+        cb = (JPEGEven(cbL, cbR) + JPEGOdd(cbL, cbR)) >> 14;
+        cr = (JPEGEven(crL, crR) + JPEGOdd(crL, crR)) >> 14;
+        JPEGStore8(&pMCU[DCTSIZE*4 + y * 8], &cb);
+        JPEGStore8(&pMCU[DCTSIZE*5 + y * 8], &cr);
+    } // for y
+} /* JPEGSubSampleVec() */
+
+void JPEGSubSample16Vec(unsigned char *pSrc, signed char *pMCU, int iPitch)
+{
+    JPEGSubSampleVec(pSrc, pMCU, iPitch, 0);
+} /* JPEGSubSample16Vec() */
+
+void JPEGSubSample32Vec(unsigned char *pSrc, signed char *pMCU, int iPitch)
+{
+    JPEGSubSampleVec(pSrc, pMCU, iPitch, 1);
+} /* JPEGSubSample32Vec() */
+
+//
+// One AAN butterfly pass of JPEGFDCT() over eight vectors; lane i of
+// v[0..7] holds line i of the block.
+//
+static inline void JPEGFDCT8(v8si *v)
+{
+    v8si tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp10, tmp11, tmp12, tmp13;
+    v8si z1, z2, z3, z4, z5, z11, z13;
+
+    tmp0 = v[0] + v[7];
+    tmp7 = v[0] - v[7];
+    tmp1 = v[1] + v[6];
+    tmp6 = v[1] - v[6];
+    tmp2 = v[2] + v[5];
+    tmp5 = v[2] - v[5];
+    tmp3 = v[3] + v[4];
+    tmp4 = v[3] - v[4];
+    // even part
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+    v[0] = tmp10 + tmp11;
+    v[4] = tmp10 - tmp11;
+    z1 = ((tmp12 + tmp13) * 181) >> 8;
+    v[2] = tmp13 + z1;
+    v[6] = tmp13 - z1;
+    // odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    z5 = (tmp10 - tmp12) * 98;
+    z2 = (z5 + tmp10 * 139) >> 8;
+    z4 = (z5 + tmp12 * 334) >> 8;
+    z3 = (tmp11 * 181) >> 8;
+    z11 = tmp7 + z3;
+    z13 = tmp7 - z3;
+    v[5] = z13 + z2;
+    v[3] = z13 - z2;
+    v[1] = z11 + z4;
+    v[7] = z11 - z4;
+} /* JPEGFDCT8() */
+
+//
+// JPEGFDCT() followed by JPEGQuantize() for one 8x8 block. The rows are
+// transformed together with one row per lane, then the columns the same
+// way, and the quantizer runs with the sign folded in instead of a branch.
+// The arithmetic matches the scalar code, so the coefficients are
+// identical.
+//
+// Returns the nonzero coefficients as a bitmask in zigzag order, already
+// cut down to the first 33 positions when the block is 'sparse' the way
+// JPEGQuantize() defines it, ready for JPEGEncodeMCUMask().
+//
+uint64_t JPEGFDCTQuantVec(signed char *pMCUSrc, signed short *pMCUDest, signed short *pQuant)
+{
+    v8si v[8], q, r, m;
+    int32_t t[64];
+    uint64_t u64Nat = 0, u64Zig = 0;
+    int i, j;
+
+    // rows, lane = row
+    for (i=0; i<8; i++)
+        v[i] = (v8si){pMCUSrc[i], pMCUSrc[8+i], pMCUSrc[16+i], pMCUSrc[24+i],
+                      pMCUSrc[32+i], pMCUSrc[40+i], pMCUSrc[48+i], pMCUSrc[56+i]};
+    JPEGFDCT8(v);
+    // columns, lane = column
+    memcpy(t, v, sizeof(t));
+    for (i=0; i<8; i++)
+        v[i] = (v8si){t[i], t[8+i], t[16+i], t[24+i], t[32+i], t[40+i], t[48+i], t[56+i]};
+    JPEGFDCT8(v);
+
+    // quantize; the second half of the table holds 65536/Q
+    for (j=0; j<8; j++)
+    {
+        signed short *pQ = &pQuant[j*8];
+        q = (v8si){pQ[0], pQ[1], pQ[2], pQ[3], pQ[4], pQ[5], pQ[6], pQ[7]};
+        pQ += 128;
+        r = (v8si){pQ[0], pQ[1], pQ[2], pQ[3], pQ[4], pQ[5], pQ[6], pQ[7]};
+        m = v[j] >> 31;
+        r = (((q >> 1) + ((v[j] ^ m) - m)) * r) >> 16;
+        r = (r ^ m) - m;
+        for (i=0; i<8; i++)
+        {
+            pMCUDest[j*8+i] = (signed short)r[i];
+            if (r[i])
+            {
+                u64Nat |= 1ULL << (j*8+i);
+                u64Zig |= 1ULL << cZigZag[j*8+i];
+            }
+        }
+    } // for j
+    if ((u64Nat >> 33) == 0)
+        u64Zig &= (1ULL << 33) - 1;
+    return u64Zig;
+} /* JPEGFDCTQuantVec() */
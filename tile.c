@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *
+ * Copyright (C) 2025 embeddedboys, Ltd.
+ *
+ * Author: Zheng Hua <hua.zheng@embeddedboys.com>
+ */
+
+#define pr_fmt(fmt) "udd-tile: " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/crc32c.h>
+
+#include "udd.h"
+
+/*
+ * Content hashes of the UDD_MCU_SIZE x UDD_MCU_SIZE tiles the device is
+ * showing. A damaged area is hashed tile by tile after conversion, and
+ * only the tiles that really changed need to be encoded and sent.
+ */
+
+int udd_tiles_init(struct udd *udd, u16 width, u16 height)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+    unsigned int count;
+
+    tiles->cols = DIV_ROUND_UP(width, UDD_MCU_SIZE);
+    tiles->rows = DIV_ROUND_UP(height, UDD_MCU_SIZE);
+    count = tiles->cols * tiles->rows;
+
+    tiles->hash = kcalloc(count, sizeof(*tiles->hash), GFP_KERNEL);
+    tiles->known = bitmap_zalloc(count, GFP_KERNEL);
+    tiles->dirty = kcalloc(count, sizeof(*tiles->dirty), GFP_KERNEL);
+    tiles->buf = kvcalloc(count, UDD_MCU_SIZE * UDD_MCU_SIZE * sizeof(u32),
+                          GFP_KERNEL);
+    if (!tiles->hash || !tiles->known || !tiles->dirty || !tiles->buf) {
+        udd_tiles_release(udd);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void udd_tiles_release(struct udd *udd)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+
+    kfree(tiles->hash);
+    bitmap_free(tiles->known);
+    kfree(tiles->dirty);
+    kvfree(tiles->buf);
+    memset(tiles, 0, sizeof(*tiles));
+}
+
+/* Forget what the device shows, the next scan reports every tile */
+void udd_tiles_invalidate(struct udd *udd)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+
+    if (tiles->known)
+        bitmap_zero(tiles->known, tiles->cols * tiles->rows);
+}
+
+/*
+ * Hash the tiles covering rect, from pixels of cpp bytes with the top
+ * left one of rect at pixels and lines pitch bytes apart, and collect
+ * the ones that differ from the last scan in tiles->dirty. The new hashes
+ * are kept; call udd_tiles_forget() if the update does not reach the
+ * device. Returns the number of changed tiles.
+ */
+unsigned int udd_tiles_scan(struct udd *udd, const u8 *pixels,
+                            unsigned int cpp, unsigned int pitch,
+                            const struct drm_rect *rect)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+    unsigned int tx, ty, x, y, w, h, i, line;
+    const u8 *src;
+    u32 hash;
+
+    tiles->count = 0;
+    tiles->clipped = false;
+
+    for (y = rect->y1; y < rect->y2; y += UDD_MCU_SIZE) {
+        ty = y / UDD_MCU_SIZE;
+        h = min_t(unsigned int, UDD_MCU_SIZE, rect->y2 - y);
+
+        for (x = rect->x1; x < rect->x2; x += UDD_MCU_SIZE) {
+            tx = x / UDD_MCU_SIZE;
+            w = min_t(unsigned int, UDD_MCU_SIZE, rect->x2 - x);
+            i = ty * tiles->cols + tx;
+
+            src = &pixels[(y - rect->y1) * pitch + (x - rect->x1) * cpp];
+            hash = ~0;
+            for (line = 0; line < h; line++, src += pitch)
+                hash = crc32c(hash, src, w * cpp);
+
+            if (test_bit(i, tiles->known) && tiles->hash[i] == hash)
+                continue;
+
+            tiles->hash[i] = hash;
+            set_bit(i, tiles->known);
+            tiles->dirty[tiles->count++] = cpu_to_le16(i);
+            if (w != UDD_MCU_SIZE || h != UDD_MCU_SIZE)
+                tiles->clipped = true;
+        }
+    }
+
+    return tiles->count;
+}
+
+/* The changed tiles did not make it to the device */
+void udd_tiles_forget(struct udd *udd)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+    unsigned int i;
+
+    for (i = 0; i < tiles->count; i++)
+        clear_bit(le16_to_cpu(tiles->dirty[i]), tiles->known);
+}
+
+/*
+ * Copy the changed tiles from the scanned pixels into tiles->buf, in
+ * dirty order, tiles->cols tiles per line. The last tile is repeated to
+ * the end of its line; the device only places the first count tiles. The
+ * size of the packed image goes to width and height.
+ */
+void udd_tiles_pack(struct udd *udd, const u8 *pixels, unsigned int cpp,
+                    unsigned int pitch, const struct drm_rect *rect,
+                    u16 *width, u16 *height)
+{
+    struct udd_tiles *tiles = &udd->tiles;
+    unsigned int per_line = min_t(unsigned int, tiles->count, tiles->cols);
+    unsigned int dst_pitch = per_line * UDD_MCU_SIZE * cpp;
+    unsigned int i, idx, line;
+    const u8 *src;
+    u8 *dst;
+
+    for (i = 0; i < tiles->count; i++) {
+        idx = le16_to_cpu(tiles->dirty[i]);
+        src = &pixels[((idx / tiles->cols) * UDD_MCU_SIZE - rect->y1) * pitch +
+                      ((idx % tiles->cols) * UDD_MCU_SIZE - rect->x1) * cpp];
+        dst = &tiles->buf[(i / per_line) * UDD_MCU_SIZE * dst_pitch +
+                          (i % per_line) * UDD_MCU_SIZE * cpp];
+
+        for (line = 0; line < UDD_MCU_SIZE; line++) {
+            memcpy(dst, src, UDD_MCU_SIZE * cpp);
+            src += pitch;
+            dst += dst_pitch;
+        }
+    }
+
+    /* fill the rest of the last line with copies of the last tile */
+    idx = tiles->count - 1;
+    for (; i % per_line; i++) {
+        src = &tiles->buf[(idx / per_line) * UDD_MCU_SIZE * dst_pitch +
+                          (idx % per_line) * UDD_MCU_SIZE * cpp];
+        dst = &tiles->buf[(i / per_line) * UDD_MCU_SIZE * dst_pitch +
+                          (i % per_line) * UDD_MCU_SIZE * cpp];
+
+        for (line = 0; line < UDD_MCU_SIZE; line++) {
+            memcpy(dst, src, UDD_MCU_SIZE * cpp);
+            src += dst_pitch;
+            dst += dst_pitch;
+        }
+    }
+
+    *width = per_line * UDD_MCU_SIZE;
+    *height = DIV_ROUND_UP(tiles->count, per_line) * UDD_MCU_SIZE;
+}
@@ -10,6 +10,15 @@
 #define __UDD_H
 
 #include <linux/kernel.h>
+#include <linux/usb.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include <drm/drm_drv.h>
 #include <drm/drm_device.h>
@@ -20,7 +29,9 @@
 
 #include <drm/drm_format_helper.h>
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_rect.h>
 #include <drm/drm_damage_helper.h>
+#include <drm/drm_vblank.h>
 #include <drm/drm_gem_dma_helper.h>
 #include <drm/drm_simple_kms_helper.h>
 #include <drm/drm_gem_atomic_helper.h>
@@ -34,15 +45,128 @@
     #define UDD_DEF_DISP_BACKEND UDD_DISP_BACKEND_DRM
 #endif
 
-// TODO: Currently only support less than 40000 bytes transfer
+/* Transfer size assumed for firmware that does not report its caps */
 #define USB_TRANS_MAX_SIZE  40000
 
+/* Largest in-band frame, keeps each transmit buffer to about 1 MB */
+#define UDD_TX_MAX_FRAME    (960 * 1024)
+
+/* Smallest per-frame budget the rate controller is given */
+#define UDD_TX_MIN_BUDGET   4096
+
+/* 4:2:0 JPEG MCU, partial updates are aligned to it */
+#define UDD_MCU_SIZE        16
+
+/* Largest width and height driven, keeps frame sizes well within 32 bits */
+#define UDD_MAX_RES         4096
+
+/* Number of frames that may be queued or on the wire at once */
+#define UDD_TX_URBS         4
+
+/* First protocol version that frames updates inside the bulk stream */
+#define UDD_PROTO_INBAND    2
+
+/* Frames remembered for matching the device's status reports */
+#define UDD_TX_SEQ_RING     16
+
+struct udd;
+
+struct udd_tx_slot {
+    struct udd             *udd;
+    struct list_head       node;
+
+    /* vendor header, sent on EP0 ahead of the bulk payload (protocol 1) */
+    struct urb             *ctrl_urb;
+    struct usb_ctrlrequest *setup;
+    u8                     *header;
+
+    /* JPEG payload, sent on EP1 straight from the coherent buffer */
+    struct urb             *bulk_urb;
+    u8                     *mem;       /* in-band header, then buf */
+    u8                     *buf;
+    dma_addr_t             dma;
+    size_t                 len;
+
+    /* in-band, the payload split in tx_chunk sized transfers */
+    struct urb             **chunk_urbs;   /* the first is bulk_urb */
+    unsigned int           chunks;
+    unsigned int           pending;        /* transfers not completed */
+
+    ktime_t                submitted;
+    u32                    frame;      /* update it belongs to, for tracing */
+    u8                     seq;
+};
+
+/* A frame put on the wire, kept until the device reports it decoded */
+struct udd_tx_seq {
+    ktime_t                sent;
+    size_t                 len;
+};
+
+/* Hashes of the tiles on the device, see tile.c */
+struct udd_tiles {
+    u16                    cols;
+    u16                    rows;
+    u32                    *hash;
+    unsigned long          *known;     /* hash matches the device */
+
+    /* result of the last udd_tiles_scan() */
+    __le16                 *dirty;
+    unsigned int           count;
+    bool                   clipped;    /* a dirty tile is cut by the edge */
+
+    /* changed tiles packed for encoding */
+    u8                     *buf;
+};
+
+/* udd_caps.codecs */
+#define UDD_CODEC_JPEG      BIT(0)  /* baseline JPEG, 4:2:0 */
+
+/* udd_caps.features */
+#define UDD_FEAT_REGION     BIT(0)  /* composites a JPEG at x, y */
+#define UDD_FEAT_TILES      BIT(1)  /* composites a tile list */
+#define UDD_FEAT_CREDITS    BIT(2)  /* reports free buffers on EP2 IN */
+
+/* What the device said it can do, see udd_caps_read() */
+struct udd_caps {
+    u8      version;        /* protocol version */
+    u16     codecs;
+    u16     features;
+    u32     max_transfer;   /* largest payload per transfer, bytes */
+    u32     decode_rate;    /* JPEG decode throughput, pixels/s, 0 unknown */
+    u8      buffers;        /* frames the device can hold, 0 unknown */
+};
+
+/* Histograms in struct udd_stats, see debugfs.c */
+enum udd_hist {
+    UDD_HIST_COPY,          /* framebuffer to encoder input, us */
+    UDD_HIST_ENCODE,        /* us */
+    UDD_HIST_TX,            /* submit to last transfer completed, us */
+    UDD_HIST_BYTES,         /* payload per frame */
+    UDD_HIST_COUNT,
+};
+
+/* Bucket 0 counts zeros, bucket n values in [2^(n-1), 2^n), the last the rest */
+#define UDD_HIST_BUCKETS    32
+
+/* Counters of one CPU, summed when read */
+struct udd_stats {
+    u64     frames;         /* queued for the device */
+    u64     bytes;
+    u64     dropped;        /* not sent, for any reason */
+    u64     oversize;       /* not sent, did not fit the transfer budget */
+    u64     tx_errors;      /* failed submissions and transfers */
+    u64     hist[UDD_HIST_COUNT][UDD_HIST_BUCKETS];
+};
+
 struct udd_display {
     u32     xres;
     u32     yres;
     u32     bpp;
     u32     fps;
     u32     rotate;
+    u32     width_mm;
+    u32     height_mm;
 };
 
 struct udd {
@@ -51,18 +175,79 @@ struct udd {
 
     /* USB specific data */
     struct usb_device      *udev;
+    struct udd_caps        caps;
+    u8                     ep_out;      /* bulk OUT taking the frames */
+    struct usb_endpoint_descriptor *ep_status;  /* EP2 IN, or NULL */
+
+    /* USB transmit engine */
+    struct udd_tx_slot     tx_slots[UDD_TX_URBS];
+    struct usb_anchor      tx_anchor;
+    struct list_head       tx_free;
+    struct list_head       tx_queue;
+    wait_queue_head_t      tx_wait;
+    spinlock_t             tx_lock;
+    bool                   tx_busy;
+    bool                   tx_stopped;
+    bool                   tx_lost;     /* see udd_tx_lost() */
+    u32                    tx_rate;     /* recent link throughput, bytes/s */
+    ktime_t                tx_done;     /* last payload completed */
+    u64                    tx_window_bytes;  /* toward the next tx_rate */
+    u64                    tx_window_us;
+    size_t                 tx_size;     /* largest payload per frame */
+    size_t                 tx_chunk;    /* largest payload per transfer */
+    unsigned int           tx_chunks;   /* transfers per frame at most */
+
+    /* Credit flow control, driven by status reports on EP2 IN */
+    struct urb             *status_urb;
+    u8                     *status_buf;
+    bool                   tx_credit_flow;
+    int                    tx_credits;  /* buffers free on the device */
+    u8                     tx_seq;      /* sequence of the next frame */
+    u8                     tx_done_seq; /* last frame reported decoded */
+    struct udd_tx_seq      tx_sent[UDD_TX_SEQ_RING];
+    u32                    tx_decode_rate;  /* device decode, bytes/s, for debugfs */
+    u32                    tx_latency;      /* submit to shown, us */
+
+    /* Performance counters, exposed in debugfs */
+    struct udd_stats __percpu *stats;
+    ktime_t                stats_since;
+    struct dentry          *debugfs;
+
+    /* Update being sent, numbered for the tracepoints */
+    u32                    frame;
+
+    /* Encoder state kept across frames */
+    struct jpeg_session    *jpeg;
+    struct udd_tiles       tiles;
 
     /* Framebuffer specific data */
     struct fb_info        *info;
     struct udd_display    *display;
+    spinlock_t            fb_rows_lock;
+    unsigned long         *fb_rows;       /* MCU rows drawn outside mmap */
+    unsigned long         *fb_rows_sent;  /* rows of the update being sent */
 
     /* DRM specific data */
-    u16 *tx_buf;
+    void *tx_buf;
     u32 pixel_format;
     struct drm_device drm;
     struct drm_simple_display_pipe pipe;
     struct drm_connector connector;
     struct drm_display_mode mode;
+    struct hrtimer vblank_timer;
+    ktime_t vblank_period;
+
+    /* Latest frame mailbox between commits and the transmit worker */
+    struct work_struct fb_work;
+    spinlock_t fb_lock;
+    struct drm_framebuffer *fb_pending;
+    struct drm_rect fb_damage;
+    u32 fb_frame;
+    u32 fb_updates;
+    struct drm_pending_vblank_event *fb_event;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    struct drm_format_conv_state fmtcnv_state;
+#endif
 };
 
 struct fb_info *udd_framebuffer_alloc(struct udd_display *display,
@@ -71,11 +256,57 @@ void udd_framebuffer_release(struct fb_info *info);
 int udd_register_framebuffer(struct fb_info *info);
 int udd_unregister_framebuffer(struct fb_info *info);
 
-struct drm_device *udd_drm_alloc(struct device *dev);
+struct drm_device *udd_drm_alloc(struct device *dev,
+                                 const struct udd_display *display);
 void udd_drm_release(struct drm_device *drm);
 int udd_drm_register(struct drm_device *drm);
 void udd_drm_unregister(struct drm_device *drm);
 
-ssize_t udd_flush(struct usb_device *udev, const u8 jpeg_data[], size_t data_size);
+int udd_tx_init(struct udd *udd);
+void udd_tx_release(struct udd *udd);
+size_t udd_tx_budget(struct udd *udd);
+struct udd_tx_slot *udd_tx_get(struct udd *udd);
+void udd_tx_put(struct udd *udd, struct udd_tx_slot *slot);
+bool udd_tx_lost(struct udd *udd);
+ssize_t udd_flush(struct udd *udd, struct udd_tx_slot *slot, size_t len);
+ssize_t udd_flush_region(struct udd *udd, struct udd_tx_slot *slot,
+                         u16 x, u16 y, u16 w, u16 h, size_t len);
+ssize_t udd_flush_tiles(struct udd *udd, struct udd_tx_slot *slot,
+                        u16 count, u16 per_line, size_t len);
+
+#define udd_stat_inc(udd, field)        this_cpu_inc((udd)->stats->field)
+#define udd_stat_add(udd, field, val)   this_cpu_add((udd)->stats->field, val)
+
+static inline void udd_stat_hist(struct udd *udd, enum udd_hist hist, u64 val)
+{
+    unsigned int bucket = val ? min_t(unsigned int, ilog2(val) + 1,
+                                      UDD_HIST_BUCKETS - 1) : 0;
+
+    this_cpu_inc(udd->stats->hist[hist][bucket]);
+}
+
+/* Time since start, in microseconds, for udd_stat_hist() */
+static inline u64 udd_stat_us(ktime_t start)
+{
+    return ktime_us_delta(ktime_get(), start);
+}
+
+int udd_stats_init(struct udd *udd);
+void udd_stats_release(struct udd *udd);
+void udd_debugfs_init(struct udd *udd);
+void udd_debugfs_release(struct udd *udd);
+void udd_debugfs_register(void);
+void udd_debugfs_unregister(void);
+
+int udd_tiles_init(struct udd *udd, u16 width, u16 height);
+void udd_tiles_release(struct udd *udd);
+void udd_tiles_invalidate(struct udd *udd);
+unsigned int udd_tiles_scan(struct udd *udd, const u8 *pixels,
+                            unsigned int cpp, unsigned int pitch,
+                            const struct drm_rect *rect);
+void udd_tiles_forget(struct udd *udd);
+void udd_tiles_pack(struct udd *udd, const u8 *pixels, unsigned int cpp,
+                    unsigned int pitch, const struct drm_rect *rect,
+                    u16 *width, u16 *height);
 
 #endif
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Tracepoints along the frame pipeline: commit, damage, copy, encode and
+ * the USB transfers. Every event carries the number of the update it
+ * belongs to; the transfer events also carry the sequence number the
+ * device reports in its status.
+ *
+ * Copyright (C) 2025 embeddedboys, Ltd.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM udd
+
+#if !defined(_UDD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UDD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(udd_update,
+    TP_PROTO(u32 frame),
+    TP_ARGS(frame),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+    ),
+    TP_printk("frame=%u", __entry->frame)
+);
+
+TRACE_EVENT(udd_damage,
+    TP_PROTO(u32 frame, int x1, int y1, int x2, int y2),
+    TP_ARGS(frame, x1, y1, x2, y2),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(int, x1)
+        __field(int, y1)
+        __field(int, x2)
+        __field(int, y2)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->x1 = x1;
+        __entry->y1 = y1;
+        __entry->x2 = x2;
+        __entry->y2 = y2;
+    ),
+    TP_printk("frame=%u rect=%d,%d-%d,%d", __entry->frame,
+              __entry->x1, __entry->y1, __entry->x2, __entry->y2)
+);
+
+DECLARE_EVENT_CLASS(udd_copy,
+    TP_PROTO(u32 frame, size_t bytes),
+    TP_ARGS(frame, bytes),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("frame=%u bytes=%zu", __entry->frame, __entry->bytes)
+);
+
+DEFINE_EVENT(udd_copy, udd_copy_begin,
+    TP_PROTO(u32 frame, size_t bytes),
+    TP_ARGS(frame, bytes)
+);
+
+DEFINE_EVENT(udd_copy, udd_copy_end,
+    TP_PROTO(u32 frame, size_t bytes),
+    TP_ARGS(frame, bytes)
+);
+
+TRACE_EVENT(udd_encode_begin,
+    TP_PROTO(u32 frame, int width, int height, size_t budget),
+    TP_ARGS(frame, width, height, budget),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(int, width)
+        __field(int, height)
+        __field(size_t, budget)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->width = width;
+        __entry->height = height;
+        __entry->budget = budget;
+    ),
+    TP_printk("frame=%u %dx%d budget=%zu", __entry->frame,
+              __entry->width, __entry->height, __entry->budget)
+);
+
+TRACE_EVENT(udd_encode_end,
+    TP_PROTO(u32 frame, size_t bytes, int ret),
+    TP_ARGS(frame, bytes, ret),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(size_t, bytes)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->bytes = bytes;
+        __entry->ret = ret;
+    ),
+    TP_printk("frame=%u bytes=%zu ret=%d", __entry->frame,
+              __entry->bytes, __entry->ret)
+);
+
+TRACE_EVENT(udd_urb_submit,
+    TP_PROTO(u32 frame, u8 seq, size_t bytes, unsigned int transfers),
+    TP_ARGS(frame, seq, bytes, transfers),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(u8, seq)
+        __field(size_t, bytes)
+        __field(unsigned int, transfers)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->seq = seq;
+        __entry->bytes = bytes;
+        __entry->transfers = transfers;
+    ),
+    TP_printk("frame=%u seq=%u bytes=%zu transfers=%u", __entry->frame,
+              __entry->seq, __entry->bytes, __entry->transfers)
+);
+
+TRACE_EVENT(udd_urb_complete,
+    TP_PROTO(u32 frame, u8 seq, u32 bytes, int status),
+    TP_ARGS(frame, seq, bytes, status),
+    TP_STRUCT__entry(
+        __field(u32, frame)
+        __field(u8, seq)
+        __field(u32, bytes)
+        __field(int, status)
+    ),
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->seq = seq;
+        __entry->bytes = bytes;
+        __entry->status = status;
+    ),
+    TP_printk("frame=%u seq=%u bytes=%u status=%d", __entry->frame,
+              __entry->seq, __entry->bytes, __entry->status)
+);
+
+#endif /* _UDD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE udd_trace
+#include <trace/define_trace.h>
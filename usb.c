@@ -10,6 +10,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
 #include <linux/fb.h>
 #include <linux/usb.h>
 #include <linux/usb/input.h>
@@ -18,6 +19,9 @@
 
 #include "udd.h"
 
+#define CREATE_TRACE_POINTS
+#include "udd_trace.h"
+
 // A jpeg image of a panda, binary data
 #include "panda.h"
 
@@ -27,6 +31,9 @@
 #define DRV_NAME "udd"
 #define UDD_DEFAULT_TIMEOUT 1000
 
+/* Transfer time the link rate is measured over, us */
+#define UDD_TX_RATE_WINDOW  (100 * USEC_PER_MSEC)
+
 #define EP0_IN_ADDR  (USB_DIR_IN  | 0)
 #define EP0_OUT_ADDR (USB_DIR_OUT | 0)
 #define EP1_OUT_ADDR (USB_DIR_OUT | 1)
@@ -39,70 +46,986 @@
 #define REQ_EP1_OUT  0X02
 #define REQ_EP2_IN   0X03
 
-ssize_t udd_flush(struct usb_device *udev, const u8 jpeg_data[], size_t data_size)
+/* Vendor header commands, first byte of the REQ_EP1_OUT data stage */
+#define UDD_CMD_FRAME   0x51    /* full-screen JPEG */
+#define UDD_CMD_REGION  0x52    /* JPEG to composite at x, y */
+#define UDD_CMD_TILES   0x53    /* tile index list, then JPEG of the tiles */
+
+#define UDD_TX_HDR_SIZE 12
+
+/* REQ_EP0_IN wValue, descriptors the device can be asked for */
+#define UDD_DESC_CAPS   0x01
+
+/*
+ * Capability descriptor, read at probe. Fields past bLength were not
+ * sent by the firmware and keep their defaults, as do zero fields.
+ */
+struct udd_caps_desc {
+    u8      bLength;
+    u8      bVersion;       /* protocol version */
+    __le16  wWidth;         /* native resolution */
+    __le16  wHeight;
+    __le16  wWidthMm;       /* panel size */
+    __le16  wHeightMm;
+    u8      bFps;           /* panel refresh */
+    u8      bBuffers;       /* frames the device can hold */
+    __le16  wCodecs;        /* UDD_CODEC_* */
+    __le16  wFeatures;      /* UDD_FEAT_* */
+    __le32  dwMaxTransfer;  /* largest payload per transfer, bytes */
+    __le32  dwDecodeRate;   /* JPEG decode throughput, pixels/s */
+} __packed;
+
+#define UDD_CAPS_DESC_MIN_SIZE  offsetof(struct udd_caps_desc, wWidthMm)
+
+/* The length field of the EP0 header is 16 bits and payloads are even */
+#define UDD_TX_MAX_SIZE 0xfffe
+
+/*
+ * From UDD_PROTO_INBAND on, every bulk transfer starts with this header
+ * instead of a control transfer carrying it; transfers can follow each
+ * other without waiting. A payload larger than the device takes in one
+ * transfer is split, each part with its own header, in order.
+ */
+struct udd_bulk_hdr {
+    u8      bCmd;           /* UDD_CMD_* */
+    u8      bSeq;           /* frame sequence, as in status reports */
+    __le16  wReserved;
+    __le32  dwLength;       /* payload bytes after the header */
+    __le32  dwOffset;       /* where they go in the whole payload */
+    __le32  dwTotal;        /* bytes of the whole payload */
+    __le16  wParam[4];      /* x, y, w, h of a region, count, per_line of tiles */
+} __packed;
+
+#define UDD_BULK_HDR_SIZE   sizeof(struct udd_bulk_hdr)
+
+#define UDD_STATUS_CREDITS  0x01
+
+/*
+ * Status report on EP2 IN, sent by devices with UDD_FEAT_CREDITS whenever
+ * a frame comes in or is shown. Frames are numbered by byte 3 of their
+ * header; both sequence fields read 0xff until the first frame.
+ */
+struct udd_status {
+    u8      bType;          /* UDD_STATUS_CREDITS */
+    u8      bFree;          /* frame buffers free once bSeq came in */
+    u8      bSeq;           /* last frame received */
+    u8      bDoneSeq;       /* last frame decoded and shown */
+    __le32  dwDecodeUs;     /* time bDoneSeq took to decode */
+} __packed;
+
+static void udd_tx_kick(struct udd *udd);
+
+/* Called with tx_lock held */
+static void udd_tx_finish(struct udd *udd, struct udd_tx_slot *slot)
 {
-    u8 control_buffer[4];
-    int rc, actual_length;
+    list_add_tail(&slot->node, &udd->tx_free);
+    udd->tx_busy = false;
+    udd_tx_kick(udd);
+    wake_up(&udd->tx_wait);
+}
+
+/*
+ * Take in a status report. The credits are recomputed from the device's
+ * count, less the frames sent since, so a lost report costs nothing.
+ * Called with tx_lock held.
+ */
+static void udd_status_update(struct udd *udd, const struct udd_status *status)
+{
+    u8 unseen = udd->tx_seq - status->bSeq - 1;
+    u8 age = udd->tx_seq - status->bDoneSeq - 1;
+    u32 us = le32_to_cpu(status->dwDecodeUs);
+    struct udd_tx_seq *done;
+    s64 latency;
+    u32 rate;
+
+    if (unseen < UDD_TX_SEQ_RING)
+        udd->tx_credits = max_t(int, status->bFree - unseen, 0);
+
+    if (status->bDoneSeq == udd->tx_done_seq || age >= UDD_TX_SEQ_RING)
+        return;
+    udd->tx_done_seq = status->bDoneSeq;
+    done = &udd->tx_sent[status->bDoneSeq % UDD_TX_SEQ_RING];
+
+    latency = ktime_us_delta(ktime_get(), done->sent);
+    if (latency > 0)
+        WRITE_ONCE(udd->tx_latency, udd->tx_latency ?
+                   (udd->tx_latency * 3 + latency) / 4 : latency);
+
+    if (!us)
+        return;
+    rate = div_u64((u64)done->len * USEC_PER_SEC, us);
+    if (udd->tx_decode_rate)
+        rate = (udd->tx_decode_rate * 3 + rate) / 4;
+    WRITE_ONCE(udd->tx_decode_rate, rate);
+}
+
+static void udd_status_complete(struct urb *urb)
+{
+    struct udd *udd = urb->context;
+    unsigned long flags;
+    int rc = urb->status;
+
+    if (rc == -ENOENT || rc == -ECONNRESET || rc == -ESHUTDOWN)
+        return;
+
+    if (!rc) {
+        spin_lock_irqsave(&udd->tx_lock, flags);
+        if (urb->actual_length >= sizeof(struct udd_status) &&
+            udd->status_buf[0] == UDD_STATUS_CREDITS)
+            udd_status_update(udd, (struct udd_status *)udd->status_buf);
+        udd_tx_kick(udd);
+        spin_unlock_irqrestore(&udd->tx_lock, flags);
+
+        rc = usb_submit_urb(urb, GFP_ATOMIC);
+        if (!rc || rc == -EPERM)
+            return;
+    }
+
+    /* no more reports, the credits would run dry; send blind instead */
+    dev_warn(udd->dev, "status endpoint failed: %d, flow control off\n", rc);
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    udd->tx_credit_flow = false;
+    udd_tx_kick(udd);
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+}
+
+/*
+ * Transfers may be queued behind each other, a payload is timed from when
+ * the one before it finished. Payloads well under the budget, regions and
+ * tiles mostly, spend their time on per-transfer overhead and would make
+ * the link look slower than it is for full frames, so they are left out
+ * once a rate is known. The rate is the bytes over the time of a whole
+ * window of transfers, not an average of per-transfer rates. Called with
+ * tx_lock held.
+ */
+static void udd_tx_update_rate(struct udd *udd, struct udd_tx_slot *slot)
+{
+    ktime_t now = ktime_get();
+    s64 us = ktime_us_delta(now, ktime_after(udd->tx_done, slot->submitted) ?
+                                 udd->tx_done : slot->submitted);
+    u32 rate;
+
+    udd->tx_done = now;
+    if (us <= 0)
+        return;
+    if (udd->tx_rate && slot->len * 2 < udd_tx_budget(udd))
+        return;
+
+    udd->tx_window_bytes += slot->len;
+    udd->tx_window_us += us;
+    if (udd->tx_window_us < UDD_TX_RATE_WINDOW)
+        return;
+
+    rate = div64_u64(udd->tx_window_bytes * USEC_PER_SEC, udd->tx_window_us);
+    udd->tx_window_bytes = 0;
+    udd->tx_window_us = 0;
+    if (udd->tx_rate)
+        rate = (udd->tx_rate * 3 + rate) / 4;
+    WRITE_ONCE(udd->tx_rate, rate);
+}
+
+static void udd_tx_bulk_complete(struct urb *urb)
+{
+    struct udd_tx_slot *slot = urb->context;
+    struct udd *udd = slot->udd;
+    unsigned long flags;
+
+    if (urb->status && urb->status != -ENOENT &&
+        urb->status != -ECONNRESET && urb->status != -ESHUTDOWN) {
+        dev_warn_ratelimited(udd->dev, "bulk transfer failed: %d\n", urb->status);
+        udd_stat_inc(udd, tx_errors);
+    }
+
+    trace_udd_urb_complete(slot->frame, slot->seq, urb->actual_length,
+                           urb->status);
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    if (urb->status)
+        udd->tx_lost = true;
+    if (--slot->pending == 0) {
+        if (!urb->status) {
+            udd_stat_hist(udd, UDD_HIST_TX, udd_stat_us(slot->submitted));
+            udd_tx_update_rate(udd, slot);
+        }
+        udd_tx_finish(udd, slot);
+    }
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+}
+
+static void udd_tx_ctrl_complete(struct urb *urb)
+{
+    struct udd_tx_slot *slot = urb->context;
+    struct udd *udd = slot->udd;
+    unsigned long flags;
+    int rc = urb->status;
+
+    /* The header is on the device, the payload can follow */
+    if (!rc) {
+        usb_anchor_urb(slot->bulk_urb, &udd->tx_anchor);
+        rc = usb_submit_urb(slot->bulk_urb, GFP_ATOMIC);
+        if (!rc)
+            return;
+        usb_unanchor_urb(slot->bulk_urb);
+    }
+
+    if (rc != -ENOENT && rc != -ECONNRESET && rc != -ESHUTDOWN) {
+        dev_warn_ratelimited(udd->dev, "frame header failed: %d\n", rc);
+        udd_stat_inc(udd, tx_errors);
+        udd_stat_inc(udd, dropped);
+    }
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    udd->tx_lost = true;
+    udd_tx_finish(udd, slot);
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+}
+
+/*
+ * Submit the transfers of an in-band frame. Returns 0 if any of them
+ * went out; the ones that did complete the slot. Called with tx_lock
+ * held.
+ */
+static int udd_tx_submit_chunks(struct udd *udd, struct udd_tx_slot *slot)
+{
+    struct urb *urb;
+    unsigned int i;
+    int rc;
+
+    slot->pending = slot->chunks;
+    for (i = 0; i < slot->chunks; i++) {
+        urb = slot->chunk_urbs[i];
+        ((struct udd_bulk_hdr *)urb->transfer_buffer)->bSeq = udd->tx_seq;
+
+        usb_anchor_urb(urb, &udd->tx_anchor);
+        rc = usb_submit_urb(urb, GFP_ATOMIC);
+        if (rc) {
+            usb_unanchor_urb(urb);
+            if (!i)
+                return rc;
+            /* the device drops the frame, it never gets all of it */
+            dev_warn_ratelimited(udd->dev, "frame cut short: %d\n", rc);
+            udd_stat_inc(udd, tx_errors);
+            udd_stat_inc(udd, dropped);
+            udd->tx_lost = true;
+            slot->pending = i;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Put the oldest queued frame on the wire. With the header on EP0 the
+ * device expects the header and the payload of one frame before the next
+ * header, so only one frame is in flight; the rest wait on tx_queue. With
+ * the header in-band all of them go to the bulk endpoint back to back.
+ * With credit flow control a frame also waits for a free buffer on the
+ * device. Called with tx_lock held.
+ */
+static void udd_tx_kick(struct udd *udd)
+{
+    bool inband = udd->caps.version >= UDD_PROTO_INBAND;
+    struct udd_tx_slot *slot;
+    int rc;
+
+    while (!udd->tx_busy && !udd->tx_stopped && !list_empty(&udd->tx_queue) &&
+           (!udd->tx_credit_flow || udd->tx_credits > 0)) {
+        slot = list_first_entry(&udd->tx_queue, struct udd_tx_slot, node);
+        list_del(&slot->node);
+
+        slot->seq = udd->tx_seq;
+        slot->submitted = ktime_get();
+        if (inband) {
+            rc = udd_tx_submit_chunks(udd, slot);
+        } else {
+            slot->header[3] = udd->tx_seq;
+            slot->pending = 1;
+            usb_anchor_urb(slot->ctrl_urb, &udd->tx_anchor);
+            rc = usb_submit_urb(slot->ctrl_urb, GFP_ATOMIC);
+            if (rc)
+                usb_unanchor_urb(slot->ctrl_urb);
+        }
+        if (rc) {
+            dev_warn_ratelimited(udd->dev, "failed to submit frame: %d\n", rc);
+            udd_stat_inc(udd, tx_errors);
+            udd_stat_inc(udd, dropped);
+            udd->tx_lost = true;
+            list_add_tail(&slot->node, &udd->tx_free);
+            wake_up(&udd->tx_wait);
+            continue;
+        }
+
+        trace_udd_urb_submit(slot->frame, slot->seq, slot->len,
+                             inband ? slot->pending : 1);
+        udd->tx_sent[udd->tx_seq % UDD_TX_SEQ_RING].sent = slot->submitted;
+        udd->tx_sent[udd->tx_seq % UDD_TX_SEQ_RING].len = slot->len;
+        udd->tx_seq++;
+        if (udd->tx_credit_flow)
+            udd->tx_credits--;
+        udd->tx_busy = !inband;
+    }
+}
+
+static struct udd_tx_slot *udd_tx_get_slot(struct udd *udd)
+{
+    struct udd_tx_slot *slot = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    if (!list_empty(&udd->tx_free)) {
+        slot = list_first_entry(&udd->tx_free, struct udd_tx_slot, node);
+        list_del(&slot->node);
+    }
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+
+    return slot;
+}
+
+/*
+ * Bytes one frame may take: what the link has recently been moving per
+ * frame interval, capped by what the device takes in one transfer. How
+ * fast the device decodes is left out; that cost goes with the pixels
+ * more than the bytes, and the credits already hold frames back for it.
+ */
+size_t udd_tx_budget(struct udd *udd)
+{
+    /* odd lengths get a pad byte */
+    size_t budget = udd->tx_size - 1;
+    u32 rate = READ_ONCE(udd->tx_rate);
+
+    if (rate && udd->display && udd->display->fps)
+        budget = clamp_t(size_t, rate / udd->display->fps,
+                         UDD_TX_MIN_BUDGET, budget);
+
+    return budget;
+}
+
+/*
+ * Take a free transmit buffer for the caller to encode a frame into;
+ * slot->buf holds udd->tx_size bytes plus JPEG_ENCODE_SLACK. Only sleeps
+ * when all UDD_TX_URBS buffers are queued or in flight. The slot goes
+ * back with one of the udd_flush*() calls, or udd_tx_put() if unused.
+ */
+struct udd_tx_slot *udd_tx_get(struct udd *udd)
+{
+    struct udd_tx_slot *slot = NULL;
+
+    if (!wait_event_timeout(udd->tx_wait,
+                            (slot = udd_tx_get_slot(udd)) || udd->tx_stopped,
+                            msecs_to_jiffies(UDD_DEFAULT_TIMEOUT))) {
+        udd_stat_inc(udd, dropped);
+        return ERR_PTR(-ETIMEDOUT);
+    }
+
+    if (!slot)
+        return ERR_PTR(-ESHUTDOWN);
+
+    return slot;
+}
+
+/*
+ * Whether a frame was lost after udd_flush*() took it, since the last
+ * call. The device may then show less than the host thinks it does.
+ */
+bool udd_tx_lost(struct udd *udd)
+{
+    unsigned long flags;
+    bool lost;
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    lost = udd->tx_lost;
+    udd->tx_lost = false;
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+
+    return lost;
+}
+
+void udd_tx_put(struct udd *udd, struct udd_tx_slot *slot)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    list_add_tail(&slot->node, &udd->tx_free);
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+    wake_up(&udd->tx_wait);
+}
+
+/*
+ * Lay the len bytes in slot->buf out as in-band transfers of at most
+ * tx_chunk payload bytes. The first part stays where it is, each later
+ * one moves up to make room for its header; frames that fit one transfer
+ * are not copied.
+ */
+static void udd_tx_split(struct udd *udd, struct udd_tx_slot *slot,
+                         const u8 *header, size_t header_size, size_t len)
+{
+    size_t stride = UDD_BULK_HDR_SIZE + udd->tx_chunk;
+    struct udd_bulk_hdr *hdr;
+    size_t offset, size;
+    struct urb *urb;
+    int i;
+
+    slot->chunks = DIV_ROUND_UP(len, udd->tx_chunk);
+
+    for (i = slot->chunks - 1; i >= 0; i--) {
+        offset = i * udd->tx_chunk;
+        size = min(len - offset, udd->tx_chunk);
+        hdr = (struct udd_bulk_hdr *)(slot->mem + i * stride);
+        if (i)
+            memmove((u8 *)hdr + UDD_BULK_HDR_SIZE, slot->buf + offset, size);
+
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->bCmd = header[0];
+        hdr->dwLength = cpu_to_le32(size);
+        hdr->dwOffset = cpu_to_le32(offset);
+        hdr->dwTotal = cpu_to_le32(len);
+        memcpy(hdr->wParam, &header[4], header_size - 4);
+
+        urb = slot->chunk_urbs[i];
+        urb->transfer_buffer = hdr;
+        urb->transfer_dma = slot->dma + i * stride;
+        urb->transfer_buffer_length = UDD_BULK_HDR_SIZE + size;
+    }
+}
+
+/*
+ * Queue the len bytes in slot->buf behind header and return without
+ * waiting for the device. The buffer goes to the USB core as it is.
+ * header is laid out for EP0: command, 16-bit length, sequence, then
+ * the command's parameters; in-band it is rewritten as udd_bulk_hdr.
+ */
+static ssize_t udd_tx_queue(struct udd *udd, struct udd_tx_slot *slot,
+                            const u8 *header, size_t header_size, size_t len)
+{
+    size_t data_size = len;
+    unsigned long flags;
+
+    if (len > udd->tx_size) {
+        udd_stat_inc(udd, oversize);
+        udd_stat_inc(udd, dropped);
+        udd_tx_put(udd, slot);
+        return -E2BIG;
+    }
+
+    slot->frame = udd->frame;
+    udd_stat_inc(udd, frames);
+    udd_stat_add(udd, bytes, len);
+    udd_stat_hist(udd, UDD_HIST_BYTES, len);
 
     /* data_size must be even for RP2350 */
-    if (data_size % 2)
-        data_size += 1;
+    if (len % 2)
+        slot->buf[len++] = 0x00;
+
+    if (udd->caps.version >= UDD_PROTO_INBAND) {
+        udd_tx_split(udd, slot, header, header_size, len);
+    } else {
+        memcpy(slot->header, header, header_size);
+        slot->header[1] = len & 0xff;
+        slot->header[2] = len >> 8;
+        slot->setup->wLength = cpu_to_le16(header_size);
+        slot->ctrl_urb->transfer_buffer_length = header_size;
+        slot->bulk_urb->transfer_buffer_length = len;
+    }
+    slot->len = len;
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    list_add_tail(&slot->node, &udd->tx_queue);
+    udd_tx_kick(udd);
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+
+    return data_size;
+}
+
+/* Send a full-screen JPEG of len bytes in slot->buf */
+ssize_t udd_flush(struct udd *udd, struct udd_tx_slot *slot, size_t len)
+{
+    u8 header[4] = { UDD_CMD_FRAME };
+
+    return udd_tx_queue(udd, slot, header, sizeof(header), len);
+}
+
+/* Send a JPEG of w x h pixels for the device to place at x, y */
+ssize_t udd_flush_region(struct udd *udd, struct udd_tx_slot *slot,
+                         u16 x, u16 y, u16 w, u16 h, size_t len)
+{
+    u8 header[UDD_TX_HDR_SIZE] = { UDD_CMD_REGION };
+
+    header[4]  = x & 0xff;
+    header[5]  = x >> 8;
+    header[6]  = y & 0xff;
+    header[7]  = y >> 8;
+    header[8]  = w & 0xff;
+    header[9]  = w >> 8;
+    header[10] = h & 0xff;
+    header[11] = h >> 8;
+
+    return udd_tx_queue(udd, slot, header, sizeof(header), len);
+}
+
+/*
+ * Send changed tiles: slot->buf starts with count little-endian tile
+ * indices (row * tiles per line + column on the screen), followed by a
+ * JPEG with the tiles in that order, per_line tiles to a line.
+ */
+ssize_t udd_flush_tiles(struct udd *udd, struct udd_tx_slot *slot,
+                        u16 count, u16 per_line, size_t len)
+{
+    u8 header[8] = { UDD_CMD_TILES };
+
+    header[4] = count & 0xff;
+    header[5] = count >> 8;
+    header[6] = per_line & 0xff;
+    header[7] = per_line >> 8;
+
+    return udd_tx_queue(udd, slot, header, sizeof(header), len);
+}
 
-    control_buffer[0] = 0x51;
-    control_buffer[1] = data_size & 0xff;
-    control_buffer[2] = data_size >> 8;
-    control_buffer[3] = 0x00;
+static void udd_status_release(struct udd *udd)
+{
+    usb_kill_urb(udd->status_urb);
+    usb_free_urb(udd->status_urb);
+    kfree(udd->status_buf);
+    udd->status_urb = NULL;
+    udd->status_buf = NULL;
+}
+
+/*
+ * Start listening for status reports if the device sends them. Without
+ * them, or if they fail, frames are sent as soon as the link is free.
+ */
+static int udd_status_init(struct udd *udd)
+{
+    struct usb_endpoint_descriptor *ep = udd->ep_status;
+    struct usb_device *udev = udd->udev;
+    size_t size;
+    int rc;
+
+    udd->tx_credit_flow = false;
+    udd->tx_seq = 0;
+    udd->tx_done_seq = 0xff;
+
+    if (!(udd->caps.features & UDD_FEAT_CREDITS) || !udd->caps.buffers)
+        return 0;
+
+    if (!ep) {
+        dev_warn(udd->dev, "no status endpoint, flow control off\n");
+        return 0;
+    }
+
+    size = max_t(size_t, sizeof(struct udd_status), usb_endpoint_maxp(ep));
+    udd->status_urb = usb_alloc_urb(0, GFP_KERNEL);
+    udd->status_buf = kmalloc(size, GFP_KERNEL);
+    if (!udd->status_urb || !udd->status_buf) {
+        udd_status_release(udd);
+        return -ENOMEM;
+    }
+
+    if (usb_endpoint_xfer_int(ep))
+        usb_fill_int_urb(udd->status_urb, udev,
+                         usb_rcvintpipe(udev, ep->bEndpointAddress),
+                         udd->status_buf, size, udd_status_complete, udd,
+                         ep->bInterval);
+    else
+        usb_fill_bulk_urb(udd->status_urb, udev,
+                          usb_rcvbulkpipe(udev, ep->bEndpointAddress),
+                          udd->status_buf, size, udd_status_complete, udd);
 
-    // request setup
-    rc = usb_control_msg(
-        udev,
-        usb_sndctrlpipe(udev, EP0_OUT_ADDR),
-        REQ_EP1_OUT,
-        TYPE_VENDOR | USB_DIR_OUT,
-        0, 0,
-        control_buffer,
-        sizeof(control_buffer),
-        UDD_DEFAULT_TIMEOUT
-    );
+    udd->tx_credits = min_t(int, udd->caps.buffers, UDD_TX_SEQ_RING);
+    udd->tx_credit_flow = true;
 
-    rc = usb_bulk_msg(
-        udev,
-        usb_sndbulkpipe(udev, EP1_OUT_ADDR),
-        (void *)jpeg_data,
-        data_size,
-        &actual_length,
-        UDD_DEFAULT_TIMEOUT
-    );
+    rc = usb_submit_urb(udd->status_urb, GFP_KERNEL);
+    if (rc) {
+        dev_warn(udd->dev, "failed to read status: %d, flow control off\n", rc);
+        udd->tx_credit_flow = false;
+    }
 
-    return actual_length;
+    return 0;
 }
 
-static int udd_bmp_blit(struct usb_device *udev, uint8_t *bmp, size_t len)
+/* Room for the payload, the in-band headers and the encoder's overrun */
+static size_t udd_tx_mem_size(struct udd *udd)
 {
-    u8 *jpeg_data;
-    ssize_t jpeg_length = 0, actual_length = 0;
+    return udd->tx_chunks * UDD_BULK_HDR_SIZE + udd->tx_size + JPEG_ENCODE_SLACK;
+}
 
-    jpeg_data = jpeg_encode_bmp(bmp, len, &jpeg_length);
-    actual_length = udd_flush(udev, jpeg_data, jpeg_length);
+static void udd_tx_free_slot(struct udd *udd, struct udd_tx_slot *slot)
+{
+    unsigned int i;
+
+    if (slot->chunk_urbs)
+        for (i = 1; i < udd->tx_chunks; i++)
+            usb_free_urb(slot->chunk_urbs[i]);
+    kfree(slot->chunk_urbs);
+    usb_free_urb(slot->ctrl_urb);
+    usb_free_urb(slot->bulk_urb);
+    kfree(slot->setup);
+    kfree(slot->header);
+    usb_free_coherent(udd->udev, udd_tx_mem_size(udd), slot->mem, slot->dma);
+}
+
+/* In-band, every part of the payload has its own transfer */
+static int udd_tx_alloc_chunks(struct udd *udd, struct udd_tx_slot *slot)
+{
+    struct urb *urb;
+    unsigned int i;
+
+    slot->chunk_urbs = kcalloc(udd->tx_chunks, sizeof(*slot->chunk_urbs),
+                               GFP_KERNEL);
+    if (!slot->chunk_urbs)
+        return -ENOMEM;
+
+    for (i = 0; i < udd->tx_chunks; i++) {
+        urb = i ? usb_alloc_urb(0, GFP_KERNEL) : slot->bulk_urb;
+        if (!urb)
+            return -ENOMEM;
+        slot->chunk_urbs[i] = urb;
+
+        usb_fill_bulk_urb(urb, udd->udev,
+                          usb_sndbulkpipe(udd->udev, udd->ep_out),
+                          slot->mem, 0, udd_tx_bulk_complete, slot);
+        /* the device takes a transfer as one part, end it explicitly */
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP | URB_ZERO_PACKET;
+    }
+
+    return 0;
+}
+
+static int udd_tx_alloc_slot(struct udd *udd, struct udd_tx_slot *slot)
+{
+    struct usb_device *udev = udd->udev;
+
+    slot->udd = udd;
+    slot->ctrl_urb = usb_alloc_urb(0, GFP_KERNEL);
+    slot->bulk_urb = usb_alloc_urb(0, GFP_KERNEL);
+    slot->setup = kmalloc(sizeof(*slot->setup), GFP_KERNEL);
+    slot->header = kmalloc(UDD_TX_HDR_SIZE, GFP_KERNEL);
+    slot->mem = usb_alloc_coherent(udev, udd_tx_mem_size(udd),
+                                   GFP_KERNEL, &slot->dma);
+    if (!slot->ctrl_urb || !slot->bulk_urb || !slot->setup ||
+        !slot->header || !slot->mem) {
+        udd_tx_free_slot(udd, slot);
+        return -ENOMEM;
+    }
+    slot->buf = slot->mem + UDD_BULK_HDR_SIZE;
+
+    /* in-band, the header goes out in the same transfer as the payload */
+    if (udd->caps.version >= UDD_PROTO_INBAND) {
+        if (udd_tx_alloc_chunks(udd, slot)) {
+            udd_tx_free_slot(udd, slot);
+            return -ENOMEM;
+        }
+        return 0;
+    }
 
-    kfree(jpeg_data);
+    slot->setup->bRequestType = TYPE_VENDOR | USB_DIR_OUT;
+    slot->setup->bRequest = REQ_EP1_OUT;
+    slot->setup->wValue = 0;
+    slot->setup->wIndex = 0;
+    slot->setup->wLength = 0;
 
+    usb_fill_control_urb(slot->ctrl_urb, udev,
+                         usb_sndctrlpipe(udev, EP0_OUT_ADDR),
+                         (u8 *)slot->setup, slot->header, 0,
+                         udd_tx_ctrl_complete, slot);
+    usb_fill_bulk_urb(slot->bulk_urb, udev,
+                      usb_sndbulkpipe(udev, udd->ep_out),
+                      slot->buf, udd->tx_size,
+                      udd_tx_bulk_complete, slot);
+    slot->bulk_urb->transfer_dma = slot->dma + UDD_BULK_HDR_SIZE;
+    slot->bulk_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+    return 0;
+}
+
+int udd_tx_init(struct udd *udd)
+{
+    int i, rc;
+
+    init_usb_anchor(&udd->tx_anchor);
+    INIT_LIST_HEAD(&udd->tx_free);
+    INIT_LIST_HEAD(&udd->tx_queue);
+    init_waitqueue_head(&udd->tx_wait);
+    spin_lock_init(&udd->tx_lock);
+    udd->tx_busy = false;
+    udd->tx_stopped = false;
+    udd->tx_lost = false;
+
+    /*
+     * Nothing bigger than a raw frame is ever sent. The EP0 header limits
+     * a frame to one transfer, in-band a frame is split in as many as it
+     * takes. Each slot is one coherent buffer, so in-band frames are also
+     * held to UDD_TX_MAX_FRAME; the budget keeps the encoder within it.
+     */
+    if (udd->caps.version >= UDD_PROTO_INBAND) {
+        udd->tx_chunk = max_t(size_t, round_down(udd->caps.max_transfer, 2), 2);
+        udd->tx_chunk = min_t(size_t, udd->tx_chunk, UDD_TX_MAX_FRAME);
+        udd->tx_size = udd->tx_chunk;
+        if (udd->display)
+            udd->tx_size = round_down(udd->display->xres * udd->display->yres *
+                                      udd->display->bpp / BITS_PER_BYTE, 2);
+        udd->tx_size = min_t(size_t, udd->tx_size, UDD_TX_MAX_FRAME);
+    } else {
+        udd->tx_size = min_t(size_t, udd->caps.max_transfer, UDD_TX_MAX_SIZE);
+        if (udd->display)
+            udd->tx_size = min_t(size_t, udd->tx_size,
+                                 udd->display->xres * udd->display->yres *
+                                 udd->display->bpp / BITS_PER_BYTE);
+        udd->tx_chunk = udd->tx_size;
+    }
+    udd->tx_chunks = DIV_ROUND_UP(udd->tx_size, udd->tx_chunk);
+
+    for (i = 0; i < UDD_TX_URBS; i++) {
+        rc = udd_tx_alloc_slot(udd, &udd->tx_slots[i]);
+        if (rc)
+            goto err_free_slots;
+        list_add_tail(&udd->tx_slots[i].node, &udd->tx_free);
+    }
+
+    rc = udd_status_init(udd);
+    if (rc)
+        goto err_free_slots;
+
+    return 0;
+
+err_free_slots:
+    while (i--)
+        udd_tx_free_slot(udd, &udd->tx_slots[i]);
+    return rc;
+}
+
+void udd_tx_release(struct udd *udd)
+{
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&udd->tx_lock, flags);
+    udd->tx_stopped = true;
+    spin_unlock_irqrestore(&udd->tx_lock, flags);
+    wake_up(&udd->tx_wait);
+
+    udd_status_release(udd);
+    usb_kill_anchored_urbs(&udd->tx_anchor);
+
+    for (i = 0; i < UDD_TX_URBS; i++)
+        udd_tx_free_slot(udd, &udd->tx_slots[i]);
+}
+
+static int udd_bmp_blit(struct udd *udd, uint8_t *bmp, size_t len)
+{
+    struct udd_tx_slot *slot;
+    ssize_t actual_length = 0;
+    size_t jpeg_length = 0;
+    int rc;
+
+    slot = udd_tx_get(udd);
+    if (IS_ERR(slot))
+        return PTR_ERR(slot);
+
+    rc = jpeg_encode_bmp(udd->jpeg, bmp, len, slot->buf, udd->tx_size - 1,
+                         &jpeg_length);
+    if (rc) {
+        udd_tx_put(udd, slot);
+        return rc;
+    }
+
+    actual_length = udd_flush(udd, slot, jpeg_length);
     if (actual_length != jpeg_length) {
-        dev_warn(&udev->dev, "Failed to blit bmp data");
+        dev_warn(udd->dev, "Failed to blit bmp data");
         return -1;
     }
 
     return 0;
 }
 
-struct udd_display default_display = {
-    .xres   = 480,
-    .yres   = 320,
-    .bpp    = 16,
-    .rotate = 0,
-    .fps    = 24,
+/*
+ * Take the endpoints from the interface, the RP2350 firmware has them at
+ * EP1 OUT and EP2 IN but other device controllers number them their own
+ * way.
+ */
+static void udd_find_endpoints(struct udd *udd)
+{
+    struct usb_host_interface *alt = to_usb_interface(udd->dev)->cur_altsetting;
+    struct usb_endpoint_descriptor *ep;
+
+    udd->ep_out = EP1_OUT_ADDR;
+    if (!usb_find_bulk_out_endpoint(alt, &ep))
+        udd->ep_out = ep->bEndpointAddress;
+
+    udd->ep_status = NULL;
+    if (!usb_find_int_in_endpoint(alt, &ep) ||
+        !usb_find_bulk_in_endpoint(alt, &ep))
+        udd->ep_status = ep;
+}
+
+/* Per-device state shared by the fbdev and DRM backends */
+static int udd_core_init(struct udd *udd)
+{
+    int rc;
+
+    udd_find_endpoints(udd);
+
+    rc = udd_stats_init(udd);
+    if (rc)
+        return rc;
+
+    udd->jpeg = jpeg_session_alloc();
+    if (!udd->jpeg) {
+        rc = -ENOMEM;
+        goto err_release_stats;
+    }
+
+    rc = udd_tiles_init(udd, udd->display->xres, udd->display->yres);
+    if (rc)
+        goto err_free_jpeg;
+
+    rc = udd_tx_init(udd);
+    if (rc)
+        goto err_release_tiles;
+
+    return 0;
+
+err_release_tiles:
+    udd_tiles_release(udd);
+err_free_jpeg:
+    jpeg_session_free(udd->jpeg);
+err_release_stats:
+    udd_stats_release(udd);
+    return rc;
+}
+
+static void udd_core_release(struct udd *udd)
+{
+    udd_tx_release(udd);
+    udd_tiles_release(udd);
+    jpeg_session_free(udd->jpeg);
+    udd_stats_release(udd);
+}
+
+static const struct udd_display default_display = {
+    .xres      = 480,
+    .yres      = 320,
+    .bpp       = 16,
+    .rotate    = 0,
+    .fps       = 24,
+    .width_mm  = 85,
+    .height_mm = 55,
+};
+
+/*
+ * What firmware without the capability request can do: full frames only,
+ * it knows no other command.
+ */
+static const struct udd_caps default_caps = {
+    .version      = 1,
+    .codecs       = UDD_CODEC_JPEG,
+    .features     = 0,
+    .max_transfer = USB_TRANS_MAX_SIZE,
+    .decode_rate  = 0,
+    .buffers      = 0,
 };
 
+/*
+ * Ask the device for its capability descriptor and size display and caps
+ * from it. Firmware that does not know the request stalls it, and the
+ * defaults above are used.
+ */
+static int udd_caps_read(struct usb_device *udev, struct udd_display *display,
+                         struct udd_caps *caps)
+{
+    struct udd_caps_desc *desc;
+    u32 pixels, fps, xres, yres;
+    int rc, len;
+
+    *display = default_display;
+    *caps = default_caps;
+
+    desc = kzalloc(sizeof(*desc), GFP_KERNEL);
+    if (!desc)
+        return -ENOMEM;
+
+    rc = usb_control_msg(udev, usb_rcvctrlpipe(udev, EP0_IN_ADDR),
+                         REQ_EP0_IN, TYPE_VENDOR | USB_DIR_IN,
+                         UDD_DESC_CAPS, 0, desc, sizeof(*desc),
+                         UDD_DEFAULT_TIMEOUT);
+    if (rc < 0) {
+        dev_info(&udev->dev, "no capability descriptor (%d), using defaults\n", rc);
+        rc = 0;
+        goto out_free;
+    }
+    if (rc < UDD_CAPS_DESC_MIN_SIZE || desc->bLength < UDD_CAPS_DESC_MIN_SIZE) {
+        dev_err(&udev->dev, "short capability descriptor, %d bytes\n", rc);
+        rc = -EPROTO;
+        goto out_free;
+    }
+    /* ignore what the firmware did not mean to send */
+    len = min_t(int, rc, desc->bLength);
+    memset((u8 *)desc + len, 0, sizeof(*desc) - len);
+
+    if (desc->bVersion)
+        caps->version = desc->bVersion;
+    if (desc->wWidth && desc->wHeight) {
+        display->xres = le16_to_cpu(desc->wWidth);
+        display->yres = le16_to_cpu(desc->wHeight);
+        display->width_mm = le16_to_cpu(desc->wWidthMm);
+        display->height_mm = le16_to_cpu(desc->wHeightMm);
+    }
+    if (desc->bFps)
+        display->fps = desc->bFps;
+    caps->buffers = desc->bBuffers;
+    if (desc->wCodecs)
+        caps->codecs = le16_to_cpu(desc->wCodecs);
+    if (len >= offsetofend(struct udd_caps_desc, wFeatures))
+        caps->features = le16_to_cpu(desc->wFeatures);
+    if (desc->dwMaxTransfer)
+        caps->max_transfer = le32_to_cpu(desc->dwMaxTransfer);
+    caps->decode_rate = le32_to_cpu(desc->dwDecodeRate);
+
+    if (!(caps->codecs & UDD_CODEC_JPEG)) {
+        dev_err(&udev->dev, "no codec in common, 0x%04x\n", caps->codecs);
+        rc = -ENODEV;
+        goto out_free;
+    }
+
+    /*
+     * The encoder reads whole MCUs and the buffer sizes are computed in
+     * 32 bits, drive the largest part of the panel that suits both.
+     */
+    xres = round_down(min_t(u32, display->xres, UDD_MAX_RES), UDD_MCU_SIZE);
+    yres = round_down(min_t(u32, display->yres, UDD_MAX_RES), UDD_MCU_SIZE);
+    if (!xres || !yres) {
+        dev_err(&udev->dev, "unusable resolution %ux%u\n",
+                display->xres, display->yres);
+        rc = -EINVAL;
+        goto out_free;
+    }
+    if (xres != display->xres || yres != display->yres) {
+        dev_warn(&udev->dev, "using %ux%u of the %ux%u panel\n",
+                 xres, yres, display->xres, display->yres);
+        display->width_mm = display->width_mm * xres / display->xres;
+        display->height_mm = display->height_mm * yres / display->yres;
+        display->xres = xres;
+        display->yres = yres;
+    }
+
+    /* no point in frames faster than the device decodes them */
+    pixels = display->xres * display->yres;
+    if (caps->decode_rate) {
+        fps = max_t(u32, caps->decode_rate / pixels, 1);
+        display->fps = min(display->fps, fps);
+    }
+
+    dev_info(&udev->dev,
+             "protocol %u, %ux%u@%u, codecs 0x%04x, features 0x%04x, %u bytes/transfer\n",
+             caps->version, display->xres, display->yres, display->fps,
+             caps->codecs, caps->features, caps->max_transfer);
+    rc = 0;
+
+out_free:
+    kfree(desc);
+    return rc;
+}
+
 static int __maybe_unused udd_fb_steup(struct usb_interface *intf,
                     const struct usb_device_id *id)
 {
@@ -110,12 +1033,22 @@ static int __maybe_unused udd_fb_steup(struct usb_interface *intf,
     struct device *dev = &intf->dev;
     // struct usb_endpoint_descriptor *endpoint_desc;
     // struct usb_host_interface *interface;
+    struct udd_display *display;
     struct fb_info *info;
+    struct udd_caps caps;
     struct udd *udd;
     int rc;
 
     printk("\n\n%s\n", __func__);
 
+    display = devm_kzalloc(dev, sizeof(*display), GFP_KERNEL);
+    if (!display)
+        return -ENOMEM;
+
+    rc = udd_caps_read(udev, display, &caps);
+    if (rc)
+        return rc;
+
     // interface = intf->cur_altsetting;
     // endpoint_desc = &interface->endpoint[0].desc;
     // printk("num of eps : %d\n", interface->desc.bNumEndpoints);
@@ -127,7 +1060,7 @@ static int __maybe_unused udd_fb_steup(struct usb_interface *intf,
     // printk("wMaxPacketSize : 0x%04x", endpoint_desc->wMaxPacketSize);
     // printk("bInterval : 0x%02x\n", endpoint_desc->bInterval);
 
-    info = udd_framebuffer_alloc(&default_display, dev);
+    info = udd_framebuffer_alloc(display, dev);
     if (!info)
         return -ENOMEM;
 
@@ -135,20 +1068,35 @@ static int __maybe_unused udd_fb_steup(struct usb_interface *intf,
     udd->udev = udev;
     udd->dev = dev;
     udd->info = info;
+    udd->display = display;
+    udd->caps = caps;
 
     dev_set_drvdata(dev, udd);
 
-    udd_bmp_blit(udev, rgb565, ARRAY_SIZE(rgb565));
+    rc = udd_core_init(udd);
+    if (rc) {
+        dev_err(udd->dev, "failed to init device state");
+        goto err_release_framebuffer;
+    }
+
+    udd_bmp_blit(udd, rgb565, ARRAY_SIZE(rgb565));
 
     rc = udd_register_framebuffer(info);
     if (rc) {
         dev_err(udd->dev, "failed to register framebuffer");
-        return rc;
+        goto err_release_core;
     }
 
     pr_info("%d KB video memory\n", info->fix.smem_len >> 10);
+    udd_debugfs_init(udd);
 
     return 0;
+
+err_release_core:
+    udd_core_release(udd);
+err_release_framebuffer:
+    udd_framebuffer_release(info);
+    return rc;
 }
 
 static void __maybe_unused udd_fb_cleanup(struct usb_interface *intf)
@@ -156,7 +1104,9 @@ static void __maybe_unused udd_fb_cleanup(struct usb_interface *intf)
     struct udd *udd = dev_get_drvdata(&intf->dev);
     printk("%s\n", __func__);
 
+    udd_debugfs_release(udd);
     udd_unregister_framebuffer(udd->info);
+    udd_core_release(udd);
     udd_framebuffer_release(udd->info);
 }
 
@@ -167,31 +1117,52 @@ static int __maybe_unused udd_drm_setup(struct usb_interface *intf,
     struct device *dev = &intf->dev;
     // struct usb_endpoint_descriptor *endpoint_desc;
     // struct usb_host_interface *interface;
+    struct udd_display *display;
     struct drm_device *drm;
+    struct udd_caps caps;
     struct udd *udd;
     int rc;
 
     printk("\n\n%s\n", __func__);
 
-    drm = udd_drm_alloc(dev);
-    if (!drm)
+    display = devm_kzalloc(dev, sizeof(*display), GFP_KERNEL);
+    if (!display)
         return -ENOMEM;
 
+    rc = udd_caps_read(udev, display, &caps);
+    if (rc)
+        return rc;
+
+    drm = udd_drm_alloc(dev, display);
+    if (IS_ERR(drm))
+        return PTR_ERR(drm);
+
     udd = container_of(drm, struct udd, drm);
     udd->udev = udev;
     udd->dev = dev;
+    udd->display = display;
+    udd->caps = caps;
 
     dev_set_drvdata(dev, udd);
-    udd_bmp_blit(udev, rgb565, ARRAY_SIZE(rgb565));
 
-    rc = udd_drm_register(drm);
+    rc = udd_core_init(udd);
     if (rc)
         goto err_free_drm;
 
+    udd_bmp_blit(udd, rgb565, ARRAY_SIZE(rgb565));
+
+    rc = udd_drm_register(drm);
+    if (rc)
+        goto err_release_core;
+
+    udd_debugfs_init(udd);
+
     return 0;
+err_release_core:
+    udd_core_release(udd);
 err_free_drm:
     udd_drm_release(drm);
-    return -1;
+    return rc;
 }
 
 static void __maybe_unused udd_drm_cleanup(struct usb_interface *intf)
@@ -200,18 +1171,19 @@ static void __maybe_unused udd_drm_cleanup(struct usb_interface *intf)
     struct drm_device *drm = &udd->drm;
 
     pr_info("%s\n", __func__);
+    udd_debugfs_release(udd);
     udd_drm_unregister(drm);
+    udd_core_release(udd);
 }
 
 static int udd_probe(struct usb_interface *intf,
                     const struct usb_device_id *id)
 {
 #if UDD_DEF_DISP_BACKEND == UDD_DISP_BACKEND_FBDEV
-    udd_fb_steup(intf, id);
+    return udd_fb_steup(intf, id);
 #else
-    udd_drm_setup(intf, id);
+    return udd_drm_setup(intf, id);
 #endif
-    return 0;
 }
 
 static void udd_disconnect(struct usb_interface *intf)
@@ -235,7 +1207,25 @@ static struct usb_driver udd_drv = {
     .disconnect = udd_disconnect,
     .id_table   = udd_ids,
 };
-module_usb_driver(udd_drv);
+
+static int __init udd_init(void)
+{
+    int rc;
+
+    udd_debugfs_register();
+    rc = usb_register(&udd_drv);
+    if (rc)
+        udd_debugfs_unregister();
+    return rc;
+}
+module_init(udd_init);
+
+static void __exit udd_exit(void)
+{
+    usb_deregister(&udd_drv);
+    udd_debugfs_unregister();
+}
+module_exit(udd_exit);
 
 MODULE_AUTHOR("Zheng Hua <hua.zheng@embeddedboys.com>");
 MODULE_DESCRIPTION("USB display device driver");